@@ -14,267 +14,744 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/boardctl.h>
 #include <syslog.h>
+#include <time.h>
 
-#include <kvdb.h>
+#include <nuttx/crc32.h>
 
 #include "bootctl.h"
+#include "bootctl_internal.h"
 
-#define BOOTCTL_SLOT_A_PATH CONFIG_UTILS_BOOTCTL_SLOT_A
-#define BOOTCTL_SLOT_A_ACTIVE "persist.boot.slot_a.active"
-#define BOOTCTL_SLOT_A_BOOTABLE "persist.boot.slot_a.bootable"
-#define BOOTCTL_SLOT_A_SUCCESSFUL "persist.boot.slot_a.successful"
-
-#define BOOTCTL_SLOT_B_PATH CONFIG_UTILS_BOOTCTL_SLOT_B
-#define BOOTCTL_SLOT_B_ACTIVE "persist.boot.slot_b.active"
-#define BOOTCTL_SLOT_B_BOOTABLE "persist.boot.slot_b.bootable"
-#define BOOTCTL_SLOT_B_SUCCESSFUL "persist.boot.slot_b.successful"
-#define BOOTCTL_SLOT_TRY "persist.boot.try"
-
-#ifdef CONFIG_UTILS_BOOTCTL_DEBUG
-#define BOOTCTL_LOG(l, f, ...) syslog(l, "%s:%d: " f, __FILE__, __LINE__, ##__VA_ARGS__)
-#else
-#define BOOTCTL_LOG(l, f, ...)
+#ifdef CONFIG_UTILS_BOOTCTL_VERIFY
+#include "../verify/avb_verify.h"
 #endif
 
-struct bootctl_slot_s {
-    bool active; /* 0: inactive, 1: active */
-    bool bootable; /* mark the slot maybe can boot */
-    bool successful; /* mark the slot can boot */
+static const char* const g_bootctl_slot[BOOTCTL_SLOT_NUM] = {
+    CONFIG_UTILS_BOOTCTL_SLOT_A,
+    CONFIG_UTILS_BOOTCTL_SLOT_B,
+#if BOOTCTL_SLOT_NUM > 2
+    CONFIG_UTILS_BOOTCTL_SLOT_C,
+#endif
+#if BOOTCTL_SLOT_NUM > 3
+    CONFIG_UTILS_BOOTCTL_SLOT_D,
+#endif
 };
 
-struct bootctl_s {
-    struct bootctl_slot_s slot[2];
-    bool try;
-};
+static uint32_t bootctl_record_crc(const void* record, size_t size)
+{
+    return crc32((const uint8_t*)record, size);
+}
+
+void bootctl_record_encode(const struct bootctl_s* boot, struct bootctl_record_s* record)
+{
+    int i;
+
+    memset(record, 0, sizeof(*record));
+    record->magic = BOOTCTL_STATE_MAGIC;
+    record->version = BOOTCTL_STATE_VERSION;
+    record->nslots = BOOTCTL_SLOT_NUM;
+    for (i = 0; i < BOOTCTL_SLOT_NUM; i++) {
+        record->slot[i] = BOOTCTL_STATE_PRIORITY(boot->slot[i].priority)
+            | BOOTCTL_STATE_TRIES(boot->slot[i].tries_remaining)
+            | (boot->slot[i].successful ? BOOTCTL_STATE_SUCCESSFUL : 0);
+    }
+
+    record->boots = boot->boots;
+    record->crc = bootctl_record_crc(record, offsetof(struct bootctl_record_s, crc));
+}
+
+/* convert the two slot version 1 record, active slot first, the other
+ * bootable or successful slot as fallback.
+ */
+
+static int bootctl_record_decode_v1(const struct bootctl_record_v1_s* record, struct bootctl_s* boot)
+{
+    int i;
+
+    if (record->crc != bootctl_record_crc(record, offsetof(struct bootctl_record_v1_s, crc))) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < 2; i++) {
+        uint8_t flags = record->slot[i];
+        struct bootctl_slot_s* slot = &boot->slot[i];
+
+        slot->successful = (flags & BOOTCTL_STATE_V1_SUCCESSFUL) != 0;
+        slot->tries_remaining = BOOTCTL_MAX_TRIES;
+        if (flags & BOOTCTL_STATE_V1_ACTIVE) {
+            slot->priority = BOOTCTL_MAX_PRIORITY;
+            if (!slot->successful && (record->flags & BOOTCTL_STATE_V1_TRY)) {
+                slot->tries_remaining = 0;
+            }
+        } else if (flags & (BOOTCTL_STATE_V1_BOOTABLE | BOOTCTL_STATE_V1_SUCCESSFUL)) {
+            slot->priority = BOOTCTL_MAX_PRIORITY - 1;
+        }
+    }
+
+    return 1;
+}
+
+int bootctl_record_decode(const struct bootctl_record_s* record, struct bootctl_s* boot)
+{
+    int i;
+
+    memset(boot, 0, sizeof(*boot));
+    if (record->magic != BOOTCTL_STATE_MAGIC) {
+        return -EINVAL;
+    }
+
+    if (record->version == 1) {
+        return bootctl_record_decode_v1((const struct bootctl_record_v1_s*)record, boot);
+    } else if (record->version != BOOTCTL_STATE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    if (record->crc != bootctl_record_crc(record, offsetof(struct bootctl_record_s, crc))) {
+        return -EINVAL;
+    }
 
-const char g_bootctl_slot_a[] = CONFIG_UTILS_BOOTCTL_SLOT_A;
-const char g_bootctl_slot_b[] = CONFIG_UTILS_BOOTCTL_SLOT_B;
+    /* slots added to or removed from the table start unbootable / are dropped */
 
-static int bootctl_write_config(struct bootctl_s* boot)
+    for (i = 0; i < BOOTCTL_SLOT_NUM && i < record->nslots; i++) {
+        boot->slot[i].priority = BOOTCTL_STATE_GET_PRIORITY(record->slot[i]);
+        boot->slot[i].tries_remaining = BOOTCTL_STATE_GET_TRIES(record->slot[i]);
+        boot->slot[i].successful = (record->slot[i] & BOOTCTL_STATE_SUCCESSFUL) != 0;
+    }
+
+    boot->boots = record->boots;
+    return record->nslots != BOOTCTL_SLOT_NUM;
+}
+
+static int bootctl_write_config(struct bootctl_handle_s* handle, bool sync)
 {
+    struct bootctl_record_s record;
     int ret;
 
-    ret = property_set_bool(BOOTCTL_SLOT_A_ACTIVE, boot->slot[0].active);
-    if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot a active failed, ret: %d", ret);
-        return ret;
+    bootctl_record_encode(&handle->boot, &record);
+    if (memcmp(&record, &handle->record, sizeof(record)) == 0) {
+        return 0;
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_A_BOOTABLE, boot->slot[0].bootable);
+    ret = bootctl_storage_store(&record, sync);
     if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot a bootable failed, ret: %d", ret);
+        BOOTCTL_LOG(LOG_ERR, "store state failed, ret: %d", ret);
         return ret;
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_A_SUCCESSFUL, boot->slot[0].successful);
-    if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot a successful failed, ret: %d", ret);
-        return ret;
+    handle->record = record;
+    return 0;
+}
+
+static void bootctl_read_config(struct bootctl_handle_s* handle)
+{
+    struct bootctl_record_s record;
+    int ret;
+
+    ret = bootctl_storage_load(&record);
+    if (ret >= 0) {
+        bool rewrite = ret > 0;
+
+        ret = bootctl_record_decode(&record, &handle->boot);
+        if (ret >= 0) {
+            if (rewrite || ret > 0) {
+                memset(&handle->record, 0, sizeof(handle->record));
+            } else {
+                handle->record = record;
+            }
+
+            return;
+        }
+
+        BOOTCTL_LOG(LOG_ERR, "state record corrupted, ret: %d", ret);
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_B_ACTIVE, boot->slot[1].active);
-    if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot b active failed, ret: %d", ret);
-        return ret;
+    /* nothing valid stored, start from an empty state */
+
+    memset(handle, 0, sizeof(*handle));
+}
+
+static bool bootctl_bootable(const struct bootctl_slot_s* slot)
+{
+    return slot->priority > 0 && (slot->successful || slot->tries_remaining > 0);
+}
+
+/* the bootable slot with the highest priority, lower index wins a tie */
+
+static int bootctl_active_slot(const struct bootctl_s* boot)
+{
+    int active = -1;
+    int i;
+
+    for (i = 0; i < BOOTCTL_SLOT_NUM; i++) {
+        if (bootctl_bootable(&boot->slot[i])
+            && (active < 0 || boot->slot[i].priority > boot->slot[active].priority)) {
+            active = i;
+        }
+    }
+
+    return active;
+}
+
+#ifndef CONFIG_UTILS_BOOTCTL_ENTRY
+
+/* the slot to update: lowest priority slot other than the active one,
+ * always the snapshot with virtual A/B.
+ */
+
+static int bootctl_update_slot(const struct bootctl_s* boot)
+{
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+    return BOOTCTL_SNAPSHOT_SLOT;
+#else
+    int active = bootctl_active_slot(boot);
+    int update = -1;
+    int i;
+
+    for (i = BOOTCTL_SLOT_NUM - 1; i >= 0; i--) {
+        if (i != active
+            && (update < 0 || boot->slot[i].priority < boot->slot[update].priority)) {
+            update = i;
+        }
+    }
+
+    return update;
+#endif
+}
+
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+
+/* held by the background merge of "bootctl success" and the merge of
+ * "bootctl update", the cow partition is merged by one task at a time
+ */
+
+static pthread_mutex_t g_bootctl_merge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool bootctl_merge_pending(const struct bootctl_s* boot)
+{
+    return bootctl_active_slot(boot) == BOOTCTL_SNAPSHOT_SLOT
+        && boot->slot[BOOTCTL_SNAPSHOT_SLOT].successful;
+}
+
+/* Once the snapshot booted successfully, merge it into the base slot and
+ * boot the base slot again, which frees the cow partition for the next
+ * update. The success is stored first, so an interrupted merge keeps
+ * booting the snapshot and is finished on the next call.
+ */
+
+static int bootctl_merge_locked(struct bootctl_handle_s* handle)
+{
+    struct bootctl_s* boot = &handle->boot;
+    int ret;
+
+    if (!bootctl_merge_pending(boot)) {
+        return 0;
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_B_BOOTABLE, boot->slot[1].bootable);
+    ret = bootctl_write_config(handle, true);
     if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot b bootable failed, ret: %d", ret);
         return ret;
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_B_SUCCESSFUL, boot->slot[1].successful);
+    ret = bootctl_snapshot_merge(g_bootctl_slot[0], CONFIG_UTILS_BOOTCTL_COW_PATH);
     if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set slot b successful failed, ret: %d", ret);
+        BOOTCTL_LOG(LOG_ERR, "merge snapshot failed, ret: %d", ret);
         return ret;
     }
 
-    ret = property_set_bool(BOOTCTL_SLOT_TRY, boot->try);
+    boot->slot[0].priority = BOOTCTL_MAX_PRIORITY;
+    boot->slot[0].tries_remaining = BOOTCTL_MAX_TRIES;
+    boot->slot[0].successful = true;
+    memset(&boot->slot[BOOTCTL_SNAPSHOT_SLOT], 0, sizeof(boot->slot[BOOTCTL_SNAPSHOT_SLOT]));
+    return bootctl_write_config(handle, true);
+}
+
+static int bootctl_merge(struct bootctl_handle_s* handle)
+{
+    int ret;
+
+    pthread_mutex_lock(&g_bootctl_merge_lock);
+    ret = bootctl_merge_locked(handle);
+    pthread_mutex_unlock(&g_bootctl_merge_lock);
+    return ret;
+}
+
+/* the state is read under the lock, a merge of "bootctl update" may have
+ * finished meanwhile
+ */
+
+static int bootctl_merge_task(int argc, char* argv[])
+{
+    struct bootctl_handle_s handle;
+    int ret;
+
+    pthread_mutex_lock(&g_bootctl_merge_lock);
+    bootctl_read_config(&handle);
+    ret = bootctl_merge_locked(&handle);
+    pthread_mutex_unlock(&g_bootctl_merge_lock);
+    return ret;
+}
+
+/* merge a successful snapshot in a task of CONFIG_UTILS_BOOTCTL_MERGE_PRIORITY,
+ * so "bootctl success" returns without waiting for the flash
+ */
+
+static void bootctl_merge_start(void)
+{
+    struct bootctl_handle_s handle;
+    int pid;
+
+    bootctl_read_config(&handle);
+    if (!bootctl_merge_pending(&handle.boot)) {
+        return;
+    }
+
+    pid = task_create("bootctl_merge", CONFIG_UTILS_BOOTCTL_MERGE_PRIORITY,
+        CONFIG_UTILS_BOOTCTL_STACKSIZE, bootctl_merge_task, NULL);
+    if (pid < 0) {
+        BOOTCTL_LOG(LOG_ERR, "start merge failed, ret: %d", -errno);
+    }
+}
+#else
+static inline int bootctl_merge(struct bootctl_handle_s* handle)
+{
+    return 0;
+}
+
+static inline void bootctl_merge_start(void) { }
+#endif
+
+struct bootctl_handle_s* bootctl_open(void)
+{
+    struct bootctl_handle_s* handle;
+
+    handle = malloc(sizeof(*handle));
+    if (handle != NULL) {
+        bootctl_read_config(handle);
+    }
+
+    return handle;
+}
+
+void bootctl_close(struct bootctl_handle_s* handle)
+{
+    free(handle);
+}
+
+int bootctl_slot_num(void)
+{
+    return BOOTCTL_SLOT_NUM;
+}
+
+int bootctl_get(struct bootctl_handle_s* handle, int slot, struct bootctl_slot_info_s* info)
+{
+    if (slot < 0 || slot >= BOOTCTL_SLOT_NUM) {
+        return -EINVAL;
+    }
+
+    info->name = g_bootctl_slot[slot];
+    info->priority = handle->boot.slot[slot].priority;
+    info->tries_remaining = handle->boot.slot[slot].tries_remaining;
+    info->successful = handle->boot.slot[slot].successful;
+    return 0;
+}
+
+int bootctl_set(struct bootctl_handle_s* handle, int slot, const struct bootctl_slot_info_s* info)
+{
+    if (slot < 0 || slot >= BOOTCTL_SLOT_NUM
+        || info->priority < 0 || info->priority > BOOTCTL_MAX_PRIORITY
+        || info->tries_remaining < 0 || info->tries_remaining > BOOTCTL_MAX_TRIES) {
+        return -EINVAL;
+    }
+
+    handle->boot.slot[slot].priority = info->priority;
+    handle->boot.slot[slot].tries_remaining = info->tries_remaining;
+    handle->boot.slot[slot].successful = info->successful;
+    return 0;
+}
+
+int bootctl_get_active(struct bootctl_handle_s* handle)
+{
+    return bootctl_active_slot(&handle->boot);
+}
+
+int bootctl_get_update(struct bootctl_handle_s* handle)
+{
+    return bootctl_update_slot(&handle->boot);
+}
+
+/* mark the slot to update unbootable, run before writing it */
+
+int bootctl_mark_update(struct bootctl_handle_s* handle)
+{
+    struct bootctl_s* boot = &handle->boot;
+    int update;
+    int ret;
+
+    /* the cow partition still holds the running system until merged */
+
+    ret = bootctl_merge(handle);
     if (ret < 0) {
-        BOOTCTL_LOG(LOG_ERR, "set try failed, ret: %d", ret);
         return ret;
     }
 
-    return property_commit();
+    update = bootctl_update_slot(boot);
+    memset(&boot->slot[update], 0, sizeof(boot->slot[update]));
+    BOOTCTL_LOG(LOG_INFO, "update slot %s", g_bootctl_slot[update]);
+    return 0;
 }
 
-static void bootctl_read_config(struct bootctl_s* boot)
+/* update slot done, give the updated slot the highest priority and
+ * BOOTCTL_MAX_TRIES trial boots.
+ */
+
+int bootctl_mark_done(struct bootctl_handle_s* handle)
 {
-    boot->slot[0].active = property_get_bool(BOOTCTL_SLOT_A_ACTIVE, false);
-    boot->slot[0].bootable = property_get_bool(BOOTCTL_SLOT_A_BOOTABLE, false);
-    boot->slot[0].successful = property_get_bool(BOOTCTL_SLOT_A_SUCCESSFUL, false);
-    boot->slot[1].active = property_get_bool(BOOTCTL_SLOT_B_ACTIVE, false);
-    boot->slot[1].bootable = property_get_bool(BOOTCTL_SLOT_B_BOOTABLE, false);
-    boot->slot[1].successful = property_get_bool(BOOTCTL_SLOT_B_SUCCESSFUL, false);
-    boot->try = property_get_bool(BOOTCTL_SLOT_TRY, false);
+    struct bootctl_s* boot = &handle->boot;
+    int update;
+    int i;
+
+    update = bootctl_update_slot(boot);
+    for (i = 0; i < BOOTCTL_SLOT_NUM; i++) {
+        if (i != update && boot->slot[i].priority > 1) {
+            boot->slot[i].priority--;
+        }
+    }
+
+    boot->slot[update].priority = BOOTCTL_MAX_PRIORITY;
+    boot->slot[update].tries_remaining = BOOTCTL_MAX_TRIES;
+    boot->slot[update].successful = false;
+    BOOTCTL_LOG(LOG_INFO, "done slot %s", g_bootctl_slot[update]);
+    return 0;
 }
 
-#ifndef CONFIG_UTILS_BOOTCTL_ENTRY
+/* mark the active slot successful, a successful snapshot is merged in
+ * the background by bootctl_success() once the success is committed
+ */
+
+int bootctl_mark_success(struct bootctl_handle_s* handle)
+{
+    struct bootctl_s* boot = &handle->boot;
+    int active;
+
+    active = bootctl_active_slot(boot);
+    if (active >= 0 && !boot->slot[active].successful) {
+        boot->slot[active].successful = true;
+        boot->slot[active].tries_remaining = BOOTCTL_MAX_TRIES;
+        BOOTCTL_LOG(LOG_INFO, "success slot %s", g_bootctl_slot[active]);
+    }
+
+    return 0;
+}
+
+/* write the state if it changed since it was read or last committed */
+
+int bootctl_commit(struct bootctl_handle_s* handle, int flags)
+{
+    return bootctl_write_config(handle, !(flags & BOOTCTL_COMMIT_NOSYNC));
+}
+
+/* one-shot helpers, each reads, changes and writes the state once */
+
+static int bootctl_apply(int (*mark)(struct bootctl_handle_s* handle))
+{
+    struct bootctl_handle_s handle;
+    int ret;
+
+    bootctl_read_config(&handle);
+    ret = mark(&handle);
+    if (ret >= 0) {
+        ret = bootctl_commit(&handle, 0);
+    }
+
+    return ret;
+}
 
 /* get the active slot */
 const char* bootctl_active(void)
 {
-    struct bootctl_s boot;
+    struct bootctl_handle_s handle;
+    int active;
 
-    bootctl_read_config(&boot);
-    if (boot.slot[0].active) {
-        return g_bootctl_slot_a;
-    } else if (boot.slot[1].active) {
-        return g_bootctl_slot_b;
-    }
-    return NULL;
+    bootctl_read_config(&handle);
+    active = bootctl_active_slot(&handle.boot);
+    return active < 0 ? NULL : g_bootctl_slot[active];
 }
 
-/* boot update, clear the slot successful and bootable, run when update slot */
+/* boot update, mark the slot to update unbootable, run when update slot */
 int bootctl_update(void)
 {
-    struct bootctl_s boot;
+    return bootctl_apply(bootctl_mark_update);
+}
 
-    bootctl_read_config(&boot);
-    if (boot.slot[0].active) {
-        boot.slot[1].successful = false;
-        boot.slot[1].bootable = false;
-        boot.slot[1].active = false;
-        BOOTCTL_LOG(LOG_INFO, "update slot a");
-    } else {
-        boot.slot[0].successful = false;
-        boot.slot[0].bootable = false;
-        boot.slot[0].active = false;
-        BOOTCTL_LOG(LOG_INFO, "update slot b");
-    }
+/* update slot done, the updated slot boots next */
 
-    return bootctl_write_config(&boot);
+int bootctl_done(void)
+{
+    return bootctl_apply(bootctl_mark_done);
 }
 
-/* update slot done, switch active slot */
+/* boot success, mark the slot successful, need run everytime */
 
-int bootctl_done(void)
+int bootctl_success(void)
 {
-    struct bootctl_s boot;
+    int ret;
 
-    bootctl_read_config(&boot);
-    if (boot.slot[0].active) {
-        boot.slot[1].bootable = true;
-        boot.slot[1].active = true;
-        boot.slot[0].active = false;
-        BOOTCTL_LOG(LOG_INFO, "done slot a");
-    } else {
-        boot.slot[0].bootable = true;
-        boot.slot[0].active = true;
-        boot.slot[1].active = false;
-        BOOTCTL_LOG(LOG_INFO, "done slot b");
+    ret = bootctl_apply(bootctl_mark_success);
+    if (ret >= 0) {
+        bootctl_merge_start();
     }
 
-    return bootctl_write_config(&boot);
+    return ret;
 }
 
-/* boot success, mark the slot successful, need run everytime */
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+static const char* const g_bootctl_decision[] = {
+    "normal",
+    "try",
+    "fallback",
+    "reset",
+    "failed",
+};
 
-int bootctl_success(void)
+/* print the boots recorded by the entry, oldest first */
+
+static int bootctl_stats(void)
 {
-    struct bootctl_s boot;
-    int ret = 0;
+    struct bootctl_stat_s stats[BOOTCTL_STATS_NUM];
+    struct bootctl_handle_s handle;
+    struct bootctl_stat_s stat;
+    uint32_t total;
+    int count = 0;
+    int ret;
+    int i;
+    int j;
+
+    bootctl_read_config(&handle);
+    ret = bootctl_storage_load_stats(stats, BOOTCTL_STATS_NUM);
+    for (i = 0; i < ret; i++) {
+        if (stats[i].crc == bootctl_record_crc(&stats[i], offsetof(struct bootctl_stat_s, crc))) {
+            stats[count++] = stats[i];
+        }
+    }
 
-    bootctl_read_config(&boot);
+    /* order by age against the current boot counter, which may wrap */
 
-    if (boot.slot[0].active) {
-        if (boot.slot[0].successful == 0) {
-            boot.try = false;
-            boot.slot[0].successful = true;
-            ret = bootctl_write_config(&boot);
-            BOOTCTL_LOG(LOG_INFO, "success slot a");
+    for (i = 1; i < count; i++) {
+        stat = stats[i];
+        for (j = i; j > 0 && (uint16_t)(handle.boot.boots - stats[j - 1].boot)
+                < (uint16_t)(handle.boot.boots - stat.boot);
+             j--) {
+            stats[j] = stats[j - 1];
         }
-    } else {
-        if (boot.slot[1].successful == 0) {
-            boot.try = false;
-            boot.slot[1].successful = true;
-            ret = bootctl_write_config(&boot);
-            BOOTCTL_LOG(LOG_INFO, "success slot b");
+
+        stats[j] = stat;
+    }
+
+    printf("%5s %-16s %-8s %5s %8s %8s %8s %8s %8s %8s\n", "boot", "slot", "decision",
+        "tries", "init", "load", "select", "verify", "store", "total");
+    for (i = 0; i < count; i++) {
+        for (total = 0, j = 0; j < BOOTCTL_PHASE_NUM; j++) {
+            total += stats[i].phase_us[j];
         }
+
+        printf("%5u %-16s %-8s %5u %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %8" PRIu32
+               " %8" PRIu32 " %8" PRIu32 "\n",
+            stats[i].boot,
+            stats[i].slot < BOOTCTL_SLOT_NUM ? g_bootctl_slot[stats[i].slot] : "-",
+            stats[i].decision <= BOOTCTL_DECISION_FAILED ? g_bootctl_decision[stats[i].decision] : "-",
+            stats[i].tries, stats[i].phase_us[BOOTCTL_PHASE_INIT],
+            stats[i].phase_us[BOOTCTL_PHASE_LOAD], stats[i].phase_us[BOOTCTL_PHASE_SELECT],
+            stats[i].phase_us[BOOTCTL_PHASE_VERIFY], stats[i].phase_us[BOOTCTL_PHASE_STORE], total);
     }
 
-    return ret;
+    return 0;
+}
+#endif
+#else
+
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+static void bootctl_stats_begin(struct bootctl_stat_s* stat, struct timespec* ts)
+{
+    memset(stat, 0, sizeof(*stat));
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/* account the time since the previous phase to phase */
+
+static void bootctl_stats_phase(struct bootctl_stat_s* stat, int phase, struct timespec* ts)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stat->phase_us[phase] = (now.tv_sec - ts->tv_sec) * 1000000
+        + (now.tv_nsec - ts->tv_nsec) / 1000;
+    *ts = now;
+}
+
+/* count the boot in the state, so each boot owns one slot of the ring */
+
+static void bootctl_stats_count(struct bootctl_s* boot, struct bootctl_stat_s* stat)
+{
+    stat->boot = ++boot->boots;
+}
+
+static void bootctl_stats_store(struct bootctl_stat_s* stat)
+{
+    int ret;
+
+    stat->crc = bootctl_record_crc(stat, offsetof(struct bootctl_stat_s, crc));
+    ret = bootctl_storage_store_stats(stat);
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "store stats failed, ret: %d", ret);
+    }
+}
+#else
+static inline void bootctl_stats_begin(struct bootctl_stat_s* stat, struct timespec* ts) { }
+static inline void bootctl_stats_phase(struct bootctl_stat_s* stat, int phase, struct timespec* ts) { }
+static inline void bootctl_stats_count(struct bootctl_s* boot, struct bootctl_stat_s* stat) { }
+static inline void bootctl_stats_store(struct bootctl_stat_s* stat) { }
+#endif
+
+#ifdef CONFIG_UTILS_BOOTCTL_VERIFY
+static int bootctl_verify_slot(int slot)
+{
+    int ret;
+
+    ret = avb_verify(g_bootctl_slot[slot], CONFIG_UTILS_BOOTCTL_VERIFY_KEY, NULL,
+        AVB_SLOT_VERIFY_FLAGS_NONE);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+        BOOTCTL_LOG(LOG_ERR, "verify %s failed, ret: %d", g_bootctl_slot[slot], ret);
+        return -EPERM;
+    }
+
+    return 0;
 }
 #else
+static inline int bootctl_verify_slot(int slot)
+{
+    return 0;
+}
+#endif
+
+/* a virtual A/B snapshot must be registered before it is verified or booted */
+
+static int bootctl_prepare_slot(int slot)
+{
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+    int ret;
+
+    if (slot == BOOTCTL_SNAPSHOT_SLOT) {
+        ret = bootctl_snapshot_register(g_bootctl_slot[0], CONFIG_UTILS_BOOTCTL_COW_PATH,
+            g_bootctl_slot[slot]);
+        if (ret < 0) {
+            BOOTCTL_LOG(LOG_ERR, "snapshot %s failed, ret: %d", g_bootctl_slot[slot], ret);
+            return ret;
+        }
+    }
+#endif
+
+    return bootctl_verify_slot(slot);
+}
 
-/* boot to a active slot, if filed, just boot a successful slot */
+/* Pick the bootable slot with the highest priority. A slot that has not
+ * booted successfully uses up one try per boot, once no try is left it
+ * is marked unbootable and the next slot by priority is chosen. A slot
+ * that fails verification is marked unbootable the same way, within
+ * this boot.
+ */
 
 static int bootctl_boot(void)
 {
     struct boardioc_boot_info_s info;
-    struct bootctl_s boot;
-
+    struct bootctl_handle_s handle;
+    struct bootctl_s* boot = &handle.boot;
+    struct bootctl_stat_s stat;
+    struct bootctl_slot_s* slot;
+    struct timespec ts;
+    int decision = BOOTCTL_DECISION_NORMAL;
+    int active;
+    int i;
+
+    bootctl_stats_begin(&stat, &ts);
     boardctl(BOARDIOC_INIT, 0);
-    bootctl_read_config(&boot);
-
-    if (boot.slot[0].active == false && boot.slot[1].active == false) {
-        memset(&boot, 0, sizeof(struct bootctl_s));
-        boot.slot[0].active = true;
-        boot.slot[0].bootable = true;
-        boot.try = true;
-    } else {
-        if (boot.slot[0].active && boot.slot[0].bootable && boot.slot[0].successful == 0) {
-
-            if (boot.try) {
-                /* try filed, just boot a successful slot */
-                boot.slot[0].active = false;
-                boot.slot[0].bootable = false;
-                BOOTCTL_LOG(LOG_INFO, "try boot slot a filed, boot to slot b");
-                goto success_slot;
-            }
+    bootctl_stats_phase(&stat, BOOTCTL_PHASE_INIT, &ts);
+    bootctl_read_config(&handle);
+    bootctl_stats_phase(&stat, BOOTCTL_PHASE_LOAD, &ts);
+
+    for (i = 0; i < BOOTCTL_SLOT_NUM; i++) {
+        slot = &boot->slot[i];
+        if (slot->priority > 0 && !bootctl_bootable(slot)) {
+            BOOTCTL_LOG(LOG_INFO, "try boot %s failed", g_bootctl_slot[i]);
+            slot->priority = 0;
+            decision = BOOTCTL_DECISION_FALLBACK;
+        }
+    }
 
-            /* try boot slot 0 */
-            info.path = g_bootctl_slot_a;
-            boot.try = true;
-            goto slot;
-        } else if (boot.slot[1].active && boot.slot[1].bootable && boot.slot[1].successful == 0) {
-
-            if (boot.try) {
-                /* try filed, just boot a successful slot */
-                boot.slot[1].active = false;
-                boot.slot[1].bootable = false;
-                BOOTCTL_LOG(LOG_INFO, "try boot slot b filed, boot to slot a");
-                goto success_slot;
-            }
+    active = bootctl_active_slot(boot);
+    if (active < 0) {
+        /* nothing bootable, e.g. first boot, fall back to slot a */
+
+        active = 0;
+        boot->slot[0].priority = BOOTCTL_MAX_PRIORITY;
+        boot->slot[0].tries_remaining = BOOTCTL_MAX_TRIES;
+        boot->slot[0].successful = false;
+        decision = BOOTCTL_DECISION_RESET;
+    }
 
-            /* try boot slot b */
+    bootctl_stats_phase(&stat, BOOTCTL_PHASE_SELECT, &ts);
 
-            info.path = g_bootctl_slot_b;
-            boot.try = true;
-            goto slot;
+    while (bootctl_prepare_slot(active) < 0) {
+        memset(&boot->slot[active], 0, sizeof(boot->slot[active]));
+        decision = BOOTCTL_DECISION_FALLBACK;
+        active = bootctl_active_slot(boot);
+        if (active < 0) {
+            break;
         }
     }
 
-success_slot:
-    if (boot.slot[0].active && boot.slot[0].successful) {
-        /* boot slot 0, normal case */
-        info.path = g_bootctl_slot_a;
-    } else if (boot.slot[1].active && boot.slot[1].successful) {
-        /* boot slot 1, normal case */
-        info.path = g_bootctl_slot_b;
-    } else if (boot.slot[0].successful) {
-        /* last try boot 1 filed, so boot slot 0, */
-        info.path = g_bootctl_slot_a;
-        boot.slot[0].active = true;
-    } else if (boot.slot[1].successful) {
-        /* last try boot 0 filed, so boot slot 1, */
-        info.path = g_bootctl_slot_b;
-        boot.slot[1].active = true;
-        boot.slot[1].bootable = true;
-    } else {
-        info.path = g_bootctl_slot_a;
-        boot.slot[0].active = true;
-        boot.slot[0].bootable = true;
-    }
-
-slot:
-    bootctl_write_config(&boot);
+    bootctl_stats_phase(&stat, BOOTCTL_PHASE_VERIFY, &ts);
+    if (active < 0) {
+        syslog(LOG_ERR, "bootctl: no slot passed verification\n");
+        stat.slot = UINT8_MAX;
+        stat.decision = BOOTCTL_DECISION_FAILED;
+        bootctl_stats_count(boot, &stat);
+        bootctl_write_config(&handle, true);
+        bootctl_stats_phase(&stat, BOOTCTL_PHASE_STORE, &ts);
+        bootctl_stats_store(&stat);
+        return -EPERM;
+    }
+
+    slot = &boot->slot[active];
+    if (!slot->successful) {
+        slot->tries_remaining--;
+        if (decision == BOOTCTL_DECISION_NORMAL) {
+            decision = BOOTCTL_DECISION_TRY;
+        }
+
+        BOOTCTL_LOG(LOG_INFO, "try boot %s, %d tries left",
+            g_bootctl_slot[active], slot->tries_remaining);
+    }
+
+    stat.slot = active;
+    stat.decision = decision;
+    stat.tries = slot->tries_remaining;
+
+    info.path = g_bootctl_slot[active];
+    bootctl_stats_count(boot, &stat);
+    bootctl_write_config(&handle, true);
+    bootctl_stats_phase(&stat, BOOTCTL_PHASE_STORE, &ts);
+    bootctl_stats_store(&stat);
     BOOTCTL_LOG(LOG_INFO, "boot to %s", info.path);
     boardctl(BOARDIOC_BOOT_IMAGE, (uintptr_t)&info);
     return 0;
@@ -297,6 +774,14 @@ int main(int argc, char* argv[])
             return bootctl_done();
         } else if (strcmp(argv[1], "slot") == 0) {
             printf("run %s\n", bootctl_active());
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+        } else if (strcmp(argv[1], "merge") == 0) {
+            return bootctl_merge_task(argc, argv);
+#endif
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+        } else if (strcmp(argv[1], "stats") == 0) {
+            return bootctl_stats();
+#endif
         } else {
             return bootctl_success();
         }
@@ -17,15 +17,48 @@
 #ifndef BOOTCTL_BOOTCTL_H
 #define BOOTCTL_BOOTCTL_H
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* leave the KVDB commit to the caller, to batch it with other writes,
+ * the journal backend always writes through
+ */
+
+#define BOOTCTL_COMMIT_NOSYNC (1 << 0)
+
+struct bootctl_handle_s;
+
+struct bootctl_slot_info_s {
+    const char* name;
+    int priority; /* 0: unbootable, up to 15 */
+    int tries_remaining;
+    bool successful;
+};
+
 const char* bootctl_active(void);
 int bootctl_update(void);
 int bootctl_done(void);
 int bootctl_success(void);
 
+/* The state is read once by bootctl_open, changed in memory and written
+ * by bootctl_commit only if it differs from what was read.
+ */
+
+struct bootctl_handle_s* bootctl_open(void);
+void bootctl_close(struct bootctl_handle_s* handle);
+int bootctl_slot_num(void);
+int bootctl_get(struct bootctl_handle_s* handle, int slot, struct bootctl_slot_info_s* info);
+int bootctl_set(struct bootctl_handle_s* handle, int slot, const struct bootctl_slot_info_s* info);
+int bootctl_get_active(struct bootctl_handle_s* handle);
+int bootctl_get_update(struct bootctl_handle_s* handle);
+int bootctl_mark_update(struct bootctl_handle_s* handle);
+int bootctl_mark_done(struct bootctl_handle_s* handle);
+int bootctl_mark_success(struct bootctl_handle_s* handle);
+int bootctl_commit(struct bootctl_handle_s* handle, int flags);
+
 #ifdef __cplusplus
 }
 #endif
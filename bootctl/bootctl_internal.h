@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BOOTCTL_BOOTCTL_INTERNAL_H
+#define BOOTCTL_BOOTCTL_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#define BOOTCTL_SLOT_NUM CONFIG_UTILS_BOOTCTL_SLOT_NUM
+#define BOOTCTL_SLOT_MAX 4
+#define BOOTCTL_MAX_PRIORITY 15
+#define BOOTCTL_MAX_TRIES CONFIG_UTILS_BOOTCTL_MAX_TRIES
+
+#define BOOTCTL_STATE_MAGIC 0x4c544342 /* "BCTL" */
+#define BOOTCTL_STATE_VERSION 2
+
+/* per slot byte of the record: priority[3:0], tries[6:4], successful[7] */
+
+#define BOOTCTL_STATE_PRIORITY(p) ((p) & 0x0f)
+#define BOOTCTL_STATE_TRIES(t) (((t) & 0x07) << 4)
+#define BOOTCTL_STATE_SUCCESSFUL (1 << 7)
+#define BOOTCTL_STATE_GET_PRIORITY(s) ((s) & 0x0f)
+#define BOOTCTL_STATE_GET_TRIES(s) (((s) >> 4) & 0x07)
+
+/* version 1: two slots with active/bootable/successful flags and one try flag */
+
+#define BOOTCTL_STATE_V1_ACTIVE (1 << 0)
+#define BOOTCTL_STATE_V1_BOOTABLE (1 << 1)
+#define BOOTCTL_STATE_V1_SUCCESSFUL (1 << 2)
+#define BOOTCTL_STATE_V1_TRY (1 << 0)
+
+#ifdef CONFIG_UTILS_BOOTCTL_DEBUG
+#define BOOTCTL_LOG(l, f, ...) syslog(l, "%s:%d: " f, __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define BOOTCTL_LOG(l, f, ...)
+#endif
+
+struct bootctl_slot_s {
+    uint8_t priority; /* 0: unbootable, the highest bootable priority boots */
+    uint8_t tries_remaining; /* trial boots left until booted successfully */
+    bool successful; /* the slot has booted successfully */
+};
+
+struct bootctl_s {
+    struct bootctl_slot_s slot[BOOTCTL_SLOT_NUM];
+    uint16_t boots; /* boot counter, only counted with UTILS_BOOTCTL_STATS */
+};
+
+/* Slot state as persisted by the storage backend, crc covers all fields
+ * before it, so a torn or stale write is detected on read.
+ */
+
+struct bootctl_record_s {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t nslots;
+    uint8_t slot[BOOTCTL_SLOT_MAX]; /* BOOTCTL_STATE_PRIORITY/TRIES/SUCCESSFUL */
+    uint16_t boots;
+    uint32_t crc;
+};
+
+struct bootctl_record_v1_s {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags; /* BOOTCTL_STATE_V1_TRY */
+    uint8_t slot[2]; /* BOOTCTL_STATE_V1_ACTIVE/BOOTABLE/SUCCESSFUL */
+    uint32_t crc;
+};
+
+/* State handle: the slot table and the record as last read or written,
+ * used to skip writes when nothing changed.
+ */
+
+struct bootctl_handle_s {
+    struct bootctl_s boot;
+    struct bootctl_record_s record;
+};
+
+/* Boot phases timed by the entry */
+
+enum bootctl_phase_e {
+    BOOTCTL_PHASE_INIT, /* BOARDIOC_INIT */
+    BOOTCTL_PHASE_LOAD, /* read the state */
+    BOOTCTL_PHASE_SELECT, /* pick the slot */
+    BOOTCTL_PHASE_VERIFY, /* verify the slot image */
+    BOOTCTL_PHASE_STORE, /* write the state */
+    BOOTCTL_PHASE_NUM
+};
+
+enum bootctl_decision_e {
+    BOOTCTL_DECISION_NORMAL, /* boot a successful slot */
+    BOOTCTL_DECISION_TRY, /* trial boot of an updated slot */
+    BOOTCTL_DECISION_FALLBACK, /* a slot ran out of tries, boot the next one */
+    BOOTCTL_DECISION_RESET, /* nothing bootable, reset to slot a */
+    BOOTCTL_DECISION_FAILED, /* no slot passed verification, not booted */
+};
+
+/* One boot as recorded by the entry, crc covers all fields before it */
+
+struct bootctl_stat_s {
+    uint16_t boot; /* bootctl_s.boots of this boot */
+    uint8_t slot;
+    uint8_t decision; /* enum bootctl_decision_e */
+    uint8_t tries; /* tries left on the slot after this boot */
+    uint8_t reserved[3];
+    uint32_t phase_us[BOOTCTL_PHASE_NUM];
+    uint32_t crc;
+};
+
+/* decode returns 1 when the record was converted from an older layout */
+
+void bootctl_record_encode(const struct bootctl_s* boot, struct bootctl_record_s* record);
+int bootctl_record_decode(const struct bootctl_record_s* record, struct bootctl_s* boot);
+
+/* Storage backend, bootctl_kvdb.c or bootctl_journal.c.
+ * load returns 0 on success, 1 when the record was converted from another
+ * format and must be written back, -ENOENT when nothing was stored yet.
+ * store without sync may leave the write pending until the caller
+ * commits, e.g. property_commit() for KVDB.
+ */
+
+int bootctl_storage_load(struct bootctl_record_s* record);
+int bootctl_storage_store(const struct bootctl_record_s* record, bool sync);
+
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+
+/* Virtual A/B, bootctl_snapshot.c: slot b is slot a overlaid with the
+ * blocks changed by the update, kept in the cow partition.
+ */
+
+#define BOOTCTL_SNAPSHOT_SLOT 1
+
+int bootctl_snapshot_register(const char* base, const char* cow, const char* path);
+int bootctl_snapshot_merge(const char* base, const char* cow);
+#endif
+
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+#define BOOTCTL_STATS_NUM CONFIG_UTILS_BOOTCTL_STATS_NUM
+
+/* Boot stats ring, kept next to the state by the storage backend.
+ * load_stats fills up to nstats of the newest entries in no particular
+ * order and returns how many, the caller checks the crc.
+ */
+
+int bootctl_storage_load_stats(struct bootctl_stat_s* stats, int nstats);
+int bootctl_storage_store_stats(const struct bootctl_stat_s* stat);
+#endif
+
+#endif /* BOOTCTL_BOOTCTL_INTERNAL_H */
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Append-only bootctl journal on a raw MTD partition.
+ *
+ * Every update appends one entry holding the whole state record into the
+ * next free program unit (page), so the common case is a single page
+ * program without erase. When the current erase block is full, the next
+ * one is erased and written, which rotates the writes over the whole
+ * partition. The newest valid state entry, by sequence number, is the
+ * state. Boot stats are appended as entries of their own, and every erase
+ * block starts with a state entry, so the state is always in the head block.
+ *
+ *   erase block 0        erase block 1
+ *   +----+----+----+     +----+----+----+
+ *   | s1 | s2 | s3 |     | s4 | ff | ff |  <- next append goes to s5
+ *   +----+----+----+     +----+----+----+
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nuttx/crc32.h>
+#include <nuttx/fs/fs.h>
+#include <nuttx/mtd/mtd.h>
+
+#include "bootctl_internal.h"
+
+#define BOOTCTL_JOURNAL_PATH CONFIG_UTILS_BOOTCTL_JOURNAL_PATH
+#define BOOTCTL_JOURNAL_MAGIC 0x4c4a4342 /* "BCJL" */
+#define BOOTCTL_JOURNAL_ERASED 0xff
+
+#define BOOTCTL_JOURNAL_STATE 1
+#define BOOTCTL_JOURNAL_STATS 2
+
+struct bootctl_journal_entry_s {
+    uint32_t magic;
+    uint32_t seq;
+    uint8_t type; /* BOOTCTL_JOURNAL_STATE/STATS */
+    uint8_t reserved[3];
+    union {
+        struct bootctl_record_s record;
+        struct bootctl_stat_s stat;
+    } u;
+    uint32_t crc; /* crc32 of all fields before it */
+};
+
+struct bootctl_journal_s {
+    struct inode* inode;
+    struct mtd_dev_s* mtd;
+    struct mtd_geometry_s geo;
+    uint8_t* buf; /* one entry, padded to whole program blocks */
+    size_t nblocks; /* program blocks per entry */
+    size_t nentries; /* entries per erase block */
+    bool scanned; /* seq/eblock/next are valid */
+    uint32_t seq; /* sequence of the newest entry, 0: empty journal */
+    uint32_t eblock; /* erase block of the newest entry */
+    size_t next; /* index of the next free entry in eblock */
+    bool valid; /* record holds the newest state */
+    struct bootctl_record_s record; /* carried into each new erase block */
+};
+
+static struct bootctl_journal_s g_bootctl_journal;
+
+/* the bootctl entry or command and ota_install's bootctl_commit() may
+ * load and append at the same time in a flat build
+ */
+
+static pthread_mutex_t g_bootctl_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t bootctl_journal_crc(const struct bootctl_journal_entry_s* entry)
+{
+    return crc32((const uint8_t*)entry, offsetof(struct bootctl_journal_entry_s, crc));
+}
+
+static bool bootctl_journal_erased(const uint8_t* buf, size_t len)
+{
+    while (len-- > 0) {
+        if (*buf++ != BOOTCTL_JOURNAL_ERASED) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* first program block of entry idx in erase block eblock */
+
+static off_t bootctl_journal_block(const struct bootctl_journal_s* journal,
+    uint32_t eblock, size_t idx)
+{
+    return (off_t)eblock * (journal->geo.erasesize / journal->geo.blocksize)
+        + idx * journal->nblocks;
+}
+
+/* read entry idx of erase block eblock into journal->buf,
+ * return 1 for a valid entry, 0 for an erased one, -errno otherwise.
+ */
+
+static int bootctl_journal_read(struct bootctl_journal_s* journal,
+    uint32_t eblock, size_t idx, struct bootctl_journal_entry_s* entry)
+{
+    ssize_t ret;
+
+    ret = MTD_BREAD(journal->mtd, bootctl_journal_block(journal, eblock, idx),
+        journal->nblocks, journal->buf);
+    if (ret != journal->nblocks) {
+        return ret < 0 ? ret : -EIO;
+    }
+
+    if (bootctl_journal_erased(journal->buf, journal->nblocks * journal->geo.blocksize)) {
+        return 0;
+    }
+
+    memcpy(entry, journal->buf, sizeof(*entry));
+    if (entry->magic != BOOTCTL_JOURNAL_MAGIC || entry->crc != bootctl_journal_crc(entry)) {
+        return -EINVAL;
+    }
+
+    return 1;
+}
+
+static int bootctl_journal_open(struct bootctl_journal_s* journal)
+{
+    size_t entsize;
+    int ret;
+
+    if (journal->mtd) {
+        return 0;
+    }
+
+    ret = find_mtddriver(BOOTCTL_JOURNAL_PATH, &journal->inode);
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "find %s failed, ret: %d", BOOTCTL_JOURNAL_PATH, ret);
+        return ret;
+    }
+
+    journal->mtd = journal->inode->u.i_mtd;
+    ret = MTD_IOCTL(journal->mtd, MTDIOC_GEOMETRY, (unsigned long)&journal->geo);
+    if (ret < 0) {
+        goto err;
+    }
+
+    entsize = sizeof(struct bootctl_journal_entry_s);
+    journal->nblocks = (entsize + journal->geo.blocksize - 1) / journal->geo.blocksize;
+    journal->nentries = journal->geo.erasesize / (journal->nblocks * journal->geo.blocksize);
+    if (journal->nentries < 2 || journal->geo.neraseblocks < 2) {
+        BOOTCTL_LOG(LOG_ERR, "journal partition too small");
+        ret = -ENOSPC;
+        goto err;
+    }
+
+    journal->buf = malloc(journal->nblocks * journal->geo.blocksize);
+    if (journal->buf == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    return 0;
+
+err:
+    close_mtddriver(journal->inode);
+    journal->mtd = NULL;
+    return ret;
+}
+
+/* Find the newest entry: the erase block whose first entry has the
+ * highest sequence is the head, then walk it up to the first erased entry.
+ * Entries that fail the crc (torn writes) are skipped.
+ */
+
+static int bootctl_journal_scan(struct bootctl_journal_s* journal)
+{
+    struct bootctl_journal_entry_s entry;
+    uint32_t eblock;
+    size_t idx;
+    int ret;
+
+    journal->scanned = true;
+    journal->valid = false;
+    journal->seq = 0;
+    journal->eblock = 0;
+    journal->next = 0;
+
+    for (eblock = 0; eblock < journal->geo.neraseblocks; eblock++) {
+        ret = bootctl_journal_read(journal, eblock, 0, &entry);
+        if (ret == 1 && entry.seq > journal->seq) {
+            journal->seq = entry.seq;
+            journal->eblock = eblock;
+        }
+    }
+
+    if (journal->seq == 0) {
+        return -ENOENT;
+    }
+
+    for (idx = 0; idx < journal->nentries; idx++) {
+        ret = bootctl_journal_read(journal, journal->eblock, idx, &entry);
+        if (ret == 0) {
+            break;
+        } else if (ret == 1 && entry.seq >= journal->seq) {
+            journal->seq = entry.seq;
+            if (entry.type == BOOTCTL_JOURNAL_STATE) {
+                journal->record = entry.u.record;
+                journal->valid = true;
+            }
+        }
+
+        journal->next = idx + 1;
+    }
+
+    return journal->valid ? 0 : -ENOENT;
+}
+
+/* program entry into the next free slot of the current erase block */
+
+static int bootctl_journal_write(struct bootctl_journal_s* journal,
+    uint8_t type, const void* data, size_t size)
+{
+    struct bootctl_journal_entry_s entry;
+    ssize_t ret;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = BOOTCTL_JOURNAL_MAGIC;
+    entry.seq = journal->seq + 1;
+    entry.type = type;
+    memcpy(&entry.u, data, size);
+    entry.crc = bootctl_journal_crc(&entry);
+
+    memset(journal->buf, BOOTCTL_JOURNAL_ERASED, journal->nblocks * journal->geo.blocksize);
+    memcpy(journal->buf, &entry, sizeof(entry));
+
+    ret = MTD_BWRITE(journal->mtd, bootctl_journal_block(journal, journal->eblock, journal->next),
+        journal->nblocks, journal->buf);
+
+    /* a failed program still consumes the entry, never program it twice */
+
+    journal->next++;
+    if (ret != journal->nblocks) {
+        BOOTCTL_LOG(LOG_ERR, "write journal failed, ret: %zd", ret);
+        return ret < 0 ? ret : -EIO;
+    }
+
+    journal->seq = entry.seq;
+    return 0;
+}
+
+static int bootctl_journal_append(uint8_t type, const void* data, size_t size)
+{
+    struct bootctl_journal_s* journal = &g_bootctl_journal;
+    int ret;
+
+    ret = bootctl_journal_open(journal);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!journal->scanned) {
+        bootctl_journal_scan(journal);
+    }
+
+    /* rotate to the next erase block when the current one is full,
+     * or format the first block of an empty journal.
+     */
+
+    if (journal->seq == 0 || journal->next >= journal->nentries) {
+        if (journal->seq != 0) {
+            journal->eblock = (journal->eblock + 1) % journal->geo.neraseblocks;
+        }
+
+        ret = MTD_ERASE(journal->mtd, journal->eblock, 1);
+        if (ret < 0) {
+            BOOTCTL_LOG(LOG_ERR, "erase journal block %" PRIu32 " failed, ret: %d",
+                journal->eblock, ret);
+            return ret;
+        }
+
+        journal->next = 0;
+
+        /* the new head block must hold the state on its own */
+
+        if (type != BOOTCTL_JOURNAL_STATE && journal->valid) {
+            ret = bootctl_journal_write(journal, BOOTCTL_JOURNAL_STATE,
+                &journal->record, sizeof(journal->record));
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    ret = bootctl_journal_write(journal, type, data, size);
+    if (ret == 0 && type == BOOTCTL_JOURNAL_STATE) {
+        memcpy(&journal->record, data, sizeof(journal->record));
+        journal->valid = true;
+    }
+
+    return ret;
+}
+
+int bootctl_storage_load(struct bootctl_record_s* record)
+{
+    struct bootctl_journal_s* journal = &g_bootctl_journal;
+    int ret;
+
+    pthread_mutex_lock(&g_bootctl_journal_lock);
+    ret = bootctl_journal_open(journal);
+    if (ret == 0) {
+        ret = bootctl_journal_scan(journal);
+    }
+
+    if (ret == 0) {
+        *record = journal->record;
+    }
+
+    pthread_mutex_unlock(&g_bootctl_journal_lock);
+    return ret;
+}
+
+/* every append is a page program that is done when it returns, there is
+ * no pending write to commit later, so sync (BOOTCTL_COMMIT_NOSYNC) has
+ * no effect on the journal
+ */
+
+int bootctl_storage_store(const struct bootctl_record_s* record, bool sync)
+{
+    int ret;
+
+    (void)sync;
+    pthread_mutex_lock(&g_bootctl_journal_lock);
+    ret = bootctl_journal_append(BOOTCTL_JOURNAL_STATE, record, sizeof(*record));
+    pthread_mutex_unlock(&g_bootctl_journal_lock);
+    return ret;
+}
+
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+
+/* stats older than the head block survive until their erase block is
+ * reused, collect the newest nstats of them over the whole partition.
+ */
+
+int bootctl_storage_load_stats(struct bootctl_stat_s* stats, int nstats)
+{
+    struct bootctl_journal_s* journal = &g_bootctl_journal;
+    struct bootctl_journal_entry_s entry;
+    uint32_t seq[BOOTCTL_STATS_NUM];
+    uint32_t eblock;
+    int count = 0;
+    size_t idx;
+    int oldest;
+    int ret;
+    int i;
+
+    if (nstats > BOOTCTL_STATS_NUM) {
+        nstats = BOOTCTL_STATS_NUM;
+    }
+
+    pthread_mutex_lock(&g_bootctl_journal_lock);
+    ret = bootctl_journal_open(journal);
+    if (ret < 0) {
+        pthread_mutex_unlock(&g_bootctl_journal_lock);
+        return ret;
+    }
+
+    for (eblock = 0; eblock < journal->geo.neraseblocks; eblock++) {
+        for (idx = 0; idx < journal->nentries; idx++) {
+            ret = bootctl_journal_read(journal, eblock, idx, &entry);
+            if (ret == 0) {
+                break;
+            } else if (ret != 1 || entry.type != BOOTCTL_JOURNAL_STATS) {
+                continue;
+            }
+
+            if (count < nstats) {
+                seq[count] = entry.seq;
+                stats[count++] = entry.u.stat;
+                continue;
+            }
+
+            for (oldest = 0, i = 1; i < count; i++) {
+                if (seq[i] < seq[oldest]) {
+                    oldest = i;
+                }
+            }
+
+            if (entry.seq > seq[oldest]) {
+                seq[oldest] = entry.seq;
+                stats[oldest] = entry.u.stat;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&g_bootctl_journal_lock);
+    return count;
+}
+
+int bootctl_storage_store_stats(const struct bootctl_stat_s* stat)
+{
+    int ret;
+
+    pthread_mutex_lock(&g_bootctl_journal_lock);
+    ret = bootctl_journal_append(BOOTCTL_JOURNAL_STATS, stat, sizeof(*stat));
+    pthread_mutex_unlock(&g_bootctl_journal_lock);
+    return ret;
+}
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kvdb.h>
+#include <nuttx/crc32.h>
+
+#include "bootctl_internal.h"
+
+#define BOOTCTL_STATE "persist.boot.state"
+#define BOOTCTL_STATS "persist.boot.stats.%d"
+
+#define BOOTCTL_SLOT_A_ACTIVE "persist.boot.slot_a.active"
+#define BOOTCTL_SLOT_A_BOOTABLE "persist.boot.slot_a.bootable"
+#define BOOTCTL_SLOT_A_SUCCESSFUL "persist.boot.slot_a.successful"
+#define BOOTCTL_SLOT_B_ACTIVE "persist.boot.slot_b.active"
+#define BOOTCTL_SLOT_B_BOOTABLE "persist.boot.slot_b.bootable"
+#define BOOTCTL_SLOT_B_SUCCESSFUL "persist.boot.slot_b.successful"
+#define BOOTCTL_SLOT_TRY "persist.boot.try"
+
+/* true while the state still lives in the legacy per-flag keys */
+
+static bool g_bootctl_legacy;
+
+/* read the state kept in the per-flag keys by older bootctl, as a
+ * version 1 record.
+ */
+
+static int bootctl_read_legacy(struct bootctl_record_s* record)
+{
+    struct bootctl_record_v1_s* v1 = (struct bootctl_record_v1_s*)record;
+
+    memset(record, 0, sizeof(*record));
+    v1->magic = BOOTCTL_STATE_MAGIC;
+    v1->version = 1;
+    v1->flags = property_get_bool(BOOTCTL_SLOT_TRY, false) ? BOOTCTL_STATE_V1_TRY : 0;
+    v1->slot[0] = (property_get_bool(BOOTCTL_SLOT_A_ACTIVE, false) ? BOOTCTL_STATE_V1_ACTIVE : 0)
+        | (property_get_bool(BOOTCTL_SLOT_A_BOOTABLE, false) ? BOOTCTL_STATE_V1_BOOTABLE : 0)
+        | (property_get_bool(BOOTCTL_SLOT_A_SUCCESSFUL, false) ? BOOTCTL_STATE_V1_SUCCESSFUL : 0);
+    v1->slot[1] = (property_get_bool(BOOTCTL_SLOT_B_ACTIVE, false) ? BOOTCTL_STATE_V1_ACTIVE : 0)
+        | (property_get_bool(BOOTCTL_SLOT_B_BOOTABLE, false) ? BOOTCTL_STATE_V1_BOOTABLE : 0)
+        | (property_get_bool(BOOTCTL_SLOT_B_SUCCESSFUL, false) ? BOOTCTL_STATE_V1_SUCCESSFUL : 0);
+
+    if (((v1->slot[0] | v1->slot[1]) & BOOTCTL_STATE_V1_ACTIVE) == 0) {
+        return -ENOENT;
+    }
+
+    v1->crc = crc32((const uint8_t*)v1, offsetof(struct bootctl_record_v1_s, crc));
+    g_bootctl_legacy = true;
+    return 1;
+}
+
+static void bootctl_delete_legacy(void)
+{
+    property_delete(BOOTCTL_SLOT_A_ACTIVE);
+    property_delete(BOOTCTL_SLOT_A_BOOTABLE);
+    property_delete(BOOTCTL_SLOT_A_SUCCESSFUL);
+    property_delete(BOOTCTL_SLOT_B_ACTIVE);
+    property_delete(BOOTCTL_SLOT_B_BOOTABLE);
+    property_delete(BOOTCTL_SLOT_B_SUCCESSFUL);
+    property_delete(BOOTCTL_SLOT_TRY);
+    g_bootctl_legacy = false;
+}
+
+int bootctl_storage_load(struct bootctl_record_s* record)
+{
+    ssize_t ret;
+
+    ret = property_get_buffer(BOOTCTL_STATE, record, sizeof(*record));
+    if (ret < 0) {
+        /* no record yet, migrate from the legacy keys on the next write */
+
+        return bootctl_read_legacy(record);
+    }
+
+    /* a version 1 record is shorter, bootctl_record_decode converts it */
+
+    if (ret == sizeof(struct bootctl_record_v1_s) && record->version == 1) {
+        return 0;
+    }
+
+    return ret == sizeof(*record) ? 0 : -EINVAL;
+}
+
+int bootctl_storage_store(const struct bootctl_record_s* record, bool sync)
+{
+    int ret;
+
+    ret = property_set_buffer(BOOTCTL_STATE, record, sizeof(*record));
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "set state failed, ret: %d", ret);
+        return ret;
+    }
+
+    if (g_bootctl_legacy) {
+        bootctl_delete_legacy();
+    }
+
+    return sync ? property_commit() : 0;
+}
+
+#ifdef CONFIG_UTILS_BOOTCTL_STATS
+
+/* one key per ring entry, indexed by the boot counter, so a boot writes
+ * a single small value instead of the whole ring.
+ */
+
+int bootctl_storage_load_stats(struct bootctl_stat_s* stats, int nstats)
+{
+    char key[PROP_NAME_MAX];
+    int count = 0;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < BOOTCTL_STATS_NUM && count < nstats; i++) {
+        snprintf(key, sizeof(key), BOOTCTL_STATS, i);
+        ret = property_get_buffer(key, &stats[count], sizeof(stats[count]));
+        if (ret == sizeof(stats[count])) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int bootctl_storage_store_stats(const struct bootctl_stat_s* stat)
+{
+    char key[PROP_NAME_MAX];
+    int ret;
+
+    snprintf(key, sizeof(key), BOOTCTL_STATS, stat->boot % BOOTCTL_STATS_NUM);
+    ret = property_set_buffer(key, stat, sizeof(*stat));
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "set stats failed, ret: %d", ret);
+        return ret;
+    }
+
+    return property_commit();
+}
+#endif
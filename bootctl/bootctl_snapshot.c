@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Virtual A/B snapshot of the base slot.
+ *
+ * The cow partition holds only the blocks an update changed, as written
+ * by tools/gen_cow.py:
+ *
+ *   +--------+----------------+---------+---------+-----
+ *   | header | map[nblocks]   | block 0 | block 1 | ...
+ *   +--------+----------------+---------+---------+-----
+ *
+ * map[i] is the base block replaced by data block i, in ascending order,
+ * the data starts at the first cow block boundary after the map. The
+ * snapshot device reads mapped blocks from the cow partition and all the
+ * others from the base partition, so the base slot stays untouched until
+ * the snapshot booted successfully and is merged into it.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nuttx/crc32.h>
+#include <nuttx/fs/fs.h>
+#include <nuttx/mtd/mtd.h>
+
+#include "bootctl_internal.h"
+
+#define BOOTCTL_COW_MAGIC 0x574f4342 /* "BCOW" */
+#define BOOTCTL_COW_VERSION 1
+#define BOOTCTL_COW_ERASED 0xffffffff
+
+struct bootctl_cow_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blocksize; /* bytes per cow block, a multiple of the base erase size */
+    uint32_t nblocks; /* number of changed blocks in map[] */
+    uint32_t mapcrc; /* crc32 of map[] */
+    uint32_t crc; /* crc32 of the fields before it */
+};
+
+struct bootctl_snapshot_s {
+    struct mtd_dev_s mtd; /* must be first */
+    struct inode* base_inode;
+    struct inode* cow_inode;
+    struct mtd_dev_s* base;
+    struct mtd_dev_s* cow;
+    struct mtd_geometry_s geo; /* of the base partition */
+    uint32_t* map;
+    uint32_t nblocks;
+    uint32_t blocksize; /* bytes per cow block */
+    size_t ratio; /* program blocks per cow block */
+    off_t data; /* first program block of the data in the cow partition */
+    uint64_t cowblocks; /* program blocks of the cow partition */
+};
+
+static struct bootctl_snapshot_s g_bootctl_snapshot;
+
+static void bootctl_snapshot_close(struct bootctl_snapshot_s* snap)
+{
+    if (snap->cow_inode) {
+        close_mtddriver(snap->cow_inode);
+    }
+
+    if (snap->base_inode) {
+        close_mtddriver(snap->base_inode);
+    }
+
+    free(snap->map);
+    memset(snap, 0, sizeof(*snap));
+}
+
+/* read and check the cow header and map, return -ENOENT for an empty
+ * (erased) cow partition.
+ */
+
+static int bootctl_snapshot_load(struct bootctl_snapshot_s* snap)
+{
+    struct bootctl_cow_header_s header;
+    size_t nbytes;
+    size_t count;
+    uint8_t* buf;
+    uint32_t i;
+    ssize_t ret;
+
+    buf = malloc(snap->geo.blocksize);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = MTD_BREAD(snap->cow, 0, 1, buf);
+    memcpy(&header, buf, sizeof(header));
+    free(buf);
+    if (ret != 1) {
+        return ret < 0 ? ret : -EIO;
+    }
+
+    if (header.magic == BOOTCTL_COW_ERASED) {
+        return -ENOENT;
+    }
+
+    if (header.magic != BOOTCTL_COW_MAGIC || header.version != BOOTCTL_COW_VERSION
+        || header.crc != crc32((const uint8_t*)&header, offsetof(struct bootctl_cow_header_s, crc))
+        || header.blocksize == 0 || header.blocksize % snap->geo.erasesize != 0
+        || header.nblocks > (uint64_t)snap->geo.erasesize * snap->geo.neraseblocks
+                / header.blocksize) {
+        BOOTCTL_LOG(LOG_ERR, "invalid cow header");
+        return -EINVAL;
+    }
+
+    snap->blocksize = header.blocksize;
+    snap->nblocks = header.nblocks;
+    snap->ratio = header.blocksize / snap->geo.blocksize;
+
+    /* header and map, rounded up to whole program blocks, then to a cow block */
+
+    nbytes = sizeof(header) + header.nblocks * sizeof(uint32_t);
+    count = (nbytes + snap->geo.blocksize - 1) / snap->geo.blocksize;
+    snap->data = (count + snap->ratio - 1) / snap->ratio * snap->ratio;
+
+    /* the map and every data block must be inside the cow partition */
+
+    if (snap->data + (uint64_t)header.nblocks * snap->ratio > snap->cowblocks) {
+        BOOTCTL_LOG(LOG_ERR, "cow partition too small for %" PRIu32 " blocks", header.nblocks);
+        return -EINVAL;
+    }
+
+    buf = malloc(count * snap->geo.blocksize);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = MTD_BREAD(snap->cow, 0, count, buf);
+    if (ret != count) {
+        free(buf);
+        return ret < 0 ? ret : -EIO;
+    }
+
+    snap->map = malloc(header.nblocks * sizeof(uint32_t) + 1);
+    if (snap->map == NULL) {
+        free(buf);
+        return -ENOMEM;
+    }
+
+    memcpy(snap->map, buf + sizeof(header), header.nblocks * sizeof(uint32_t));
+    free(buf);
+
+    if (header.mapcrc != crc32((const uint8_t*)snap->map, header.nblocks * sizeof(uint32_t))) {
+        BOOTCTL_LOG(LOG_ERR, "invalid cow map");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < header.nblocks; i++) {
+        if ((i > 0 && snap->map[i] <= snap->map[i - 1])
+            || ((uint64_t)snap->map[i] + 1) * header.blocksize
+                > (uint64_t)snap->geo.erasesize * snap->geo.neraseblocks) {
+            BOOTCTL_LOG(LOG_ERR, "invalid cow map entry %" PRIu32, i);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int bootctl_snapshot_open(struct bootctl_snapshot_s* snap, const char* base, const char* cow)
+{
+    struct mtd_geometry_s geo;
+    int ret;
+
+    ret = find_mtddriver(base, &snap->base_inode);
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "find %s failed, ret: %d", base, ret);
+        goto err;
+    }
+
+    ret = find_mtddriver(cow, &snap->cow_inode);
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "find %s failed, ret: %d", cow, ret);
+        goto err;
+    }
+
+    snap->base = snap->base_inode->u.i_mtd;
+    snap->cow = snap->cow_inode->u.i_mtd;
+    ret = MTD_IOCTL(snap->base, MTDIOC_GEOMETRY, (unsigned long)&snap->geo);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = MTD_IOCTL(snap->cow, MTDIOC_GEOMETRY, (unsigned long)&geo);
+    if (ret < 0) {
+        goto err;
+    }
+
+    if (geo.blocksize != snap->geo.blocksize) {
+        BOOTCTL_LOG(LOG_ERR, "cow and base program block size differ");
+        ret = -EINVAL;
+        goto err;
+    }
+
+    snap->cowblocks = (uint64_t)geo.erasesize * geo.neraseblocks / geo.blocksize;
+
+    ret = bootctl_snapshot_load(snap);
+    if (ret < 0) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    bootctl_snapshot_close(snap);
+    return ret;
+}
+
+/* index of cow block block in map[], -1 when unchanged */
+
+static int bootctl_snapshot_find(const struct bootctl_snapshot_s* snap, uint32_t block)
+{
+    uint32_t lo = 0;
+    uint32_t hi = snap->nblocks;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (snap->map[mid] == block) {
+            return mid;
+        } else if (snap->map[mid] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return -1;
+}
+
+static int bootctl_snapshot_erase(struct mtd_dev_s* dev, off_t startblock, size_t nblocks)
+{
+    return -EROFS;
+}
+
+static ssize_t bootctl_snapshot_bread(struct mtd_dev_s* dev, off_t startblock,
+    size_t nblocks, uint8_t* buf)
+{
+    struct bootctl_snapshot_s* snap = (struct bootctl_snapshot_s*)dev;
+    size_t done = 0;
+
+    /* split at cow block boundaries, each piece comes from one partition */
+
+    while (done < nblocks) {
+        off_t block = startblock + done;
+        size_t offset = block % snap->ratio;
+        size_t count = snap->ratio - offset;
+        ssize_t ret;
+        int idx;
+
+        if (count > nblocks - done) {
+            count = nblocks - done;
+        }
+
+        idx = bootctl_snapshot_find(snap, block / snap->ratio);
+        if (idx >= 0) {
+            ret = MTD_BREAD(snap->cow, snap->data + (off_t)idx * snap->ratio + offset,
+                count, buf + done * snap->geo.blocksize);
+        } else {
+            ret = MTD_BREAD(snap->base, block, count, buf + done * snap->geo.blocksize);
+        }
+
+        if (ret != count) {
+            return ret < 0 ? ret : -EIO;
+        }
+
+        done += count;
+    }
+
+    return nblocks;
+}
+
+static ssize_t bootctl_snapshot_bwrite(struct mtd_dev_s* dev, off_t startblock,
+    size_t nblocks, const uint8_t* buf)
+{
+    return -EROFS;
+}
+
+static int bootctl_snapshot_ioctl(struct mtd_dev_s* dev, int cmd, unsigned long arg)
+{
+    struct bootctl_snapshot_s* snap = (struct bootctl_snapshot_s*)dev;
+
+    if (cmd == MTDIOC_GEOMETRY) {
+        memcpy((struct mtd_geometry_s*)arg, &snap->geo, sizeof(snap->geo));
+        return 0;
+    }
+
+    /* no XIP base, the image is not contiguous in flash */
+
+    return -ENOTTY;
+}
+
+int bootctl_snapshot_register(const char* base, const char* cow, const char* path)
+{
+    struct bootctl_snapshot_s* snap = &g_bootctl_snapshot;
+    int ret;
+
+    if (snap->map) {
+        return 0;
+    }
+
+    ret = bootctl_snapshot_open(snap, base, cow);
+    if (ret < 0) {
+        return ret;
+    }
+
+    snap->mtd.erase = bootctl_snapshot_erase;
+    snap->mtd.bread = bootctl_snapshot_bread;
+    snap->mtd.bwrite = bootctl_snapshot_bwrite;
+    snap->mtd.ioctl = bootctl_snapshot_ioctl;
+
+    ret = register_mtddriver(path, &snap->mtd, 0444, NULL);
+    if (ret < 0) {
+        BOOTCTL_LOG(LOG_ERR, "register %s failed, ret: %d", path, ret);
+        bootctl_snapshot_close(snap);
+    }
+
+    return ret;
+}
+
+/* Copy the changed blocks into the base partition, then erase the cow
+ * header. Interrupted merges are restarted from the beginning: until the
+ * header is erased the snapshot still reads every changed block from the
+ * cow partition, and blocks already merged are skipped by the compare.
+ */
+
+int bootctl_snapshot_merge(const char* base, const char* cow)
+{
+    struct bootctl_snapshot_s snap;
+    uint32_t neblocks;
+    uint8_t* buf;
+    uint32_t i;
+    ssize_t ret;
+
+    memset(&snap, 0, sizeof(snap));
+    ret = bootctl_snapshot_open(&snap, base, cow);
+    if (ret == -ENOENT) {
+        return 0;
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    buf = malloc(2 * snap.blocksize);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    neblocks = snap.blocksize / snap.geo.erasesize;
+    for (i = 0; i < snap.nblocks; i++) {
+        off_t block = (off_t)snap.map[i] * snap.ratio;
+
+        ret = MTD_BREAD(snap.cow, snap.data + (off_t)i * snap.ratio, snap.ratio, buf);
+        if (ret != snap.ratio) {
+            goto err;
+        }
+
+        ret = MTD_BREAD(snap.base, block, snap.ratio, buf + snap.blocksize);
+        if (ret != snap.ratio) {
+            goto err;
+        }
+
+        if (memcmp(buf, buf + snap.blocksize, snap.blocksize) == 0) {
+            continue;
+        }
+
+        ret = MTD_ERASE(snap.base, (off_t)snap.map[i] * neblocks, neblocks);
+        if (ret < 0) {
+            goto err;
+        }
+
+        ret = MTD_BWRITE(snap.base, block, snap.ratio, buf);
+        if (ret != snap.ratio) {
+            goto err;
+        }
+    }
+
+    ret = MTD_ERASE(snap.cow, 0, 1);
+    if (ret >= 0) {
+        BOOTCTL_LOG(LOG_INFO, "merged %" PRIu32 " blocks into %s", snap.nblocks, base);
+        ret = 0;
+        goto out;
+    }
+
+err:
+    BOOTCTL_LOG(LOG_ERR, "merge block %" PRIu32 " failed, ret: %zd", i, ret);
+    ret = ret < 0 ? ret : -EIO;
+
+out:
+    free(buf);
+    bootctl_snapshot_close(&snap);
+    return ret;
+}
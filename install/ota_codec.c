@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Streaming decode of lz4 and zstd payloads. The payload is a single
+ * lz4 or zstd frame stored in the package, read in bufsize chunks and
+ * decoded into the caller's buffer, the decoder keeps at most one window
+ * of history: 64 KiB for lz4, 1 << CONFIG_UTILS_OTA_INSTALL_ZSTD_WINDOWLOG
+ * for zstd.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef CONFIG_UTILS_OTA_INSTALL_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ota_install.h"
+
+static int ota_codec_fill(struct ota_codec_s* codec)
+{
+    int ret;
+
+    ret = codec->src.read(codec->src.handle, codec->in, codec->insize);
+    if (ret <= 0) {
+        OTA_LOG(LOG_ERR, "read payload failed, ret: %d", ret);
+        return ret < 0 ? ret : -EINVAL;
+    }
+
+    codec->inpos = 0;
+    codec->inlen = ret;
+    return 0;
+}
+
+/* decode into buf from codec->in, *len is updated to the bytes decoded.
+ * 1: the frame is complete, 0: more input is needed.
+ */
+
+static int ota_codec_decode(struct ota_codec_s* codec, uint8_t* buf, size_t* len)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_LZ4
+    if (codec->type == OTA_CODEC_LZ4) {
+        size_t insize = codec->inlen - codec->inpos;
+        size_t ret;
+
+        ret = LZ4F_decompress(codec->lz4, buf, len, codec->in + codec->inpos, &insize, NULL);
+        if (LZ4F_isError(ret)) {
+            OTA_LOG(LOG_ERR, "lz4: %s", LZ4F_getErrorName(ret));
+            return -EINVAL;
+        }
+
+        codec->inpos += insize;
+        return ret == 0;
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ZSTD
+    if (codec->type == OTA_CODEC_ZSTD) {
+        ZSTD_inBuffer in = { codec->in, codec->inlen, codec->inpos };
+        ZSTD_outBuffer out = { buf, *len, 0 };
+        size_t ret;
+
+        ret = ZSTD_decompressStream(codec->zstd, &out, &in);
+        if (ZSTD_isError(ret)) {
+            OTA_LOG(LOG_ERR, "zstd: %s", ZSTD_getErrorName(ret));
+            return -EINVAL;
+        }
+
+        codec->inpos = in.pos;
+        *len = out.pos;
+        return ret == 0;
+    }
+#endif
+
+    return -ENOTSUP;
+}
+
+int ota_codec_open(struct ota_codec_s* codec, const struct ota_src_s* src, int type,
+    size_t bufsize)
+{
+    int ret = -ENOTSUP;
+
+    memset(codec, 0, sizeof(*codec));
+    codec->src = *src;
+    codec->type = type;
+    codec->insize = bufsize;
+    codec->in = malloc(bufsize);
+    if (codec->in == NULL) {
+        return -ENOMEM;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_LZ4
+    if (type == OTA_CODEC_LZ4) {
+        ret = LZ4F_isError(LZ4F_createDecompressionContext(&codec->lz4, LZ4F_VERSION))
+            ? -ENOMEM
+            : 0;
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ZSTD
+    if (type == OTA_CODEC_ZSTD) {
+        codec->zstd = ZSTD_createDStream();
+        ret = codec->zstd == NULL ? -ENOMEM : 0;
+        if (ret == 0
+            && ZSTD_isError(ZSTD_DCtx_setParameter(codec->zstd, ZSTD_d_windowLogMax,
+                CONFIG_UTILS_OTA_INSTALL_ZSTD_WINDOWLOG))) {
+            ZSTD_freeDStream(codec->zstd);
+            ret = -EINVAL;
+        }
+    }
+#endif
+
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "codec %d is not available, ret: %d", type, ret);
+        free(codec->in);
+    }
+
+    return ret;
+}
+
+/* up to len bytes of the image, 0: the whole frame was decoded */
+
+ssize_t ota_codec_read(struct ota_codec_s* codec, uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    size_t n;
+    int ret;
+
+    while (done < len && !codec->end) {
+        n = len - done;
+        ret = ota_codec_decode(codec, buf + done, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += n;
+
+        /* the decoder still holds output of a block whose input was all
+         * consumed, only refill once it returns nothing more
+         */
+
+        if (ret == 0 && n == 0 && codec->inpos == codec->inlen) {
+            ret = ota_codec_fill(codec);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (ret > 0) {
+
+            /* one frame per payload, read to the end so its crc is checked */
+
+            codec->end = true;
+            if (codec->inpos != codec->inlen) {
+                OTA_LOG(LOG_ERR, "data after the payload frame");
+                return -EINVAL;
+            }
+
+            ret = codec->src.read(codec->src.handle, codec->in, 1);
+            if (ret != 0) {
+                OTA_LOG(LOG_ERR, "data after the payload frame");
+                return ret < 0 ? ret : -EINVAL;
+            }
+        }
+    }
+
+    return done;
+}
+
+void ota_codec_close(struct ota_codec_s* codec)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_LZ4
+    if (codec->lz4 != NULL) {
+        LZ4F_freeDecompressionContext(codec->lz4);
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ZSTD
+    if (codec->zstd != NULL) {
+        ZSTD_freeDStream(codec->zstd);
+    }
+#endif
+
+    free(codec->in);
+}
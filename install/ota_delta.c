@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Streaming ddelta apply: the patch is read from its package entry and
+ * the old image from the active slot, the new image comes out in the
+ * order it is written, so nothing is staged in a file.
+ *
+ * A DDELTA40 patch, all integers big endian:
+ *
+ *   "DDELTA40" | new size (8) | entry ... | 0 0 0
+ *   entry: diff (8) | extra (8) | seek (8, signed) | diff bytes | extra bytes
+ *
+ * diff bytes are added to the old image at the old position, extra bytes
+ * are copied as is, then the old position moves by seek.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ota_install.h"
+
+#define OTA_DELTA_MAGIC "DDELTA40"
+
+static uint64_t ota_delta_be64(const uint8_t* p)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        value = (value << 8) | p[i];
+    }
+
+    return value;
+}
+
+/* exactly len bytes of the patch, a short patch is corrupted */
+
+static int ota_delta_patch(struct ota_delta_s* delta, uint8_t* buf, size_t len)
+{
+    int ret;
+
+    while (len > 0) {
+        ret = delta->src.read(delta->src.handle, buf, len);
+        if (ret <= 0) {
+            OTA_LOG(LOG_ERR, "read patch failed, ret: %d", ret);
+            return ret < 0 ? ret : -EINVAL;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int ota_delta_old(struct ota_delta_s* delta, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pread(delta->fd, delta->old + done, len - done, delta->pos + done);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            OTA_LOG(LOG_ERR, "read old image at %jd failed", (intmax_t)(delta->pos + done));
+            return ret < 0 ? -errno : -EINVAL;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* the next entry header, the old position moves by the last seek first */
+
+static int ota_delta_entry(struct ota_delta_s* delta)
+{
+    uint8_t header[24];
+    int ret;
+
+    delta->pos += delta->seek;
+    if (delta->pos < 0) {
+        return -EINVAL;
+    }
+
+    ret = ota_delta_patch(delta, header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    delta->diff = ota_delta_be64(header);
+    delta->extra = ota_delta_be64(header + 8);
+    delta->seek = (int64_t)ota_delta_be64(header + 16);
+    if (delta->diff == 0 && delta->extra == 0 && delta->seek == 0) {
+
+        /* read to the end of the entry, so its crc is checked */
+
+        delta->end = true;
+        ret = delta->src.read(delta->src.handle, header, 1);
+        if (ret != 0) {
+            return ret < 0 ? ret : -EINVAL;
+        }
+
+        return delta->written == delta->size ? 0 : -EINVAL;
+    }
+
+    if (delta->diff + delta->extra > delta->size - delta->written) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int ota_delta_open(struct ota_delta_s* delta, const struct ota_src_s* src,
+    const char* path, uint64_t size, size_t bufsize)
+{
+    uint8_t header[16];
+    int ret;
+
+    memset(delta, 0, sizeof(*delta));
+    delta->src = *src;
+    delta->size = size;
+
+    ret = ota_delta_patch(delta, header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* the in-place patches of gen_ota_zip.py --blksz are not DDELTA40 */
+
+    if (memcmp(header, OTA_DELTA_MAGIC, 8) != 0 || ota_delta_be64(header + 8) != size) {
+        OTA_LOG(LOG_ERR, "not a " OTA_DELTA_MAGIC " patch of %" PRIu64 " bytes", size);
+        return -EINVAL;
+    }
+
+    delta->old = malloc(bufsize);
+    if (delta->old == NULL) {
+        return -ENOMEM;
+    }
+
+    delta->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (delta->fd < 0) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", path, ret);
+        free(delta->old);
+        return ret;
+    }
+
+    return 0;
+}
+
+/* up to len bytes of the new image, len is at most the bufsize of
+ * ota_delta_open. 0: the whole image was read.
+ */
+
+ssize_t ota_delta_read(struct ota_delta_s* delta, uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    size_t n;
+    size_t i;
+    int ret;
+
+    while (done < len && !delta->end) {
+        if (delta->diff > 0) {
+            n = delta->diff < len - done ? delta->diff : len - done;
+            ret = ota_delta_patch(delta, buf + done, n);
+            if (ret >= 0) {
+                ret = ota_delta_old(delta, n);
+            }
+
+            if (ret < 0) {
+                return ret;
+            }
+
+            for (i = 0; i < n; i++) {
+                buf[done + i] += delta->old[i];
+            }
+
+            delta->pos += n;
+            delta->diff -= n;
+        } else if (delta->extra > 0) {
+            n = delta->extra < len - done ? delta->extra : len - done;
+            ret = ota_delta_patch(delta, buf + done, n);
+            if (ret < 0) {
+                return ret;
+            }
+
+            delta->extra -= n;
+        } else {
+            ret = ota_delta_entry(delta);
+            if (ret < 0) {
+                OTA_LOG(LOG_ERR, "bad patch entry at %" PRIu64, delta->written);
+                return ret;
+            }
+
+            continue;
+        }
+
+        done += n;
+        delta->written += n;
+    }
+
+    return done;
+}
+
+void ota_delta_close(struct ota_delta_s* delta)
+{
+    close(delta->fd);
+    free(delta->old);
+}
@@ -0,0 +1,1422 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Install an ota.zip in one pass: every vela_<xxx>.bin (or .elf) entry is
+ * inflated straight into /dev/<xxx>, then optionally verified with avb,
+ * and the update slot is handed to bootctl. Nothing is extracted to a
+ * temporary file system. A package with ota.manifest is installed as
+ * listed there instead, without running ota.sh, and its delta images are
+ * patched from the active slot as they are written. An ota.stream is read
+ * once from a pipe in the order of its entries, by a single worker.
+ *
+ * Images are written by a pool of workers, each with its own zip handle.
+ * Partitions listed in the same group of CONFIG_UTILS_OTA_INSTALL_DEVICES
+ * share one flash device, at most CONFIG_UTILS_OTA_INSTALL_DEVICE_JOBS of
+ * them are written at the same time.
+ *
+ * With CONFIG_UTILS_OTA_INSTALL_CHECKPOINT the bytes written to each
+ * partition are recorded in persist.ota.ckpt.<xxx> together with the crc
+ * and sizes of the entry, so an install interrupted by a power loss
+ * resumes from the last checkpoint of the same package.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <unzip.h>
+#include <zlib.h>
+
+#include <kvdb.h>
+
+#include "ota_install.h"
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+#include "../bootctl/bootctl.h"
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_VERIFY
+#include "../verify/avb_verify.h"
+#endif
+
+#define OTA_IMAGE_PREFIX "vela_"
+#define OTA_IMAGE_SKIP "vela_ota" /* the package's own tools, not flashed */
+
+#define OTA_CKPT_PREFIX "persist.ota.ckpt."
+
+/* persist.ota.ckpt.<xxx>, offset == size once the image was verified */
+
+struct ota_ckpt_s {
+    uint32_t crc; /* zip crc of the entry */
+    uint32_t reserved;
+    uint64_t csize; /* compressed size */
+    uint64_t size;
+    uint64_t offset; /* bytes written and synced */
+};
+
+union ota_stream_u {
+    struct ota_delta_s delta;
+    struct ota_codec_s codec;
+    struct ota_stored_s stored;
+};
+
+struct ota_job_s {
+    uint8_t type; /* OTA_OP_WRITE or OTA_OP_DELTA */
+    char name[OTA_PATH_MAX];
+    char path[OTA_PATH_MAX];
+    char key[OTA_PATH_MAX]; /* avb key from the manifest, "": ctx->key */
+    char source[OTA_PATH_MAX]; /* old image of a delta */
+    uint8_t codec; /* enum ota_codec_e of a write */
+    bool stored; /* read straight from the package, not through minizip */
+    uint32_t crc; /* of the image written */
+    uint64_t csize;
+    uint64_t size;
+    unz64_file_pos pos;
+    size_t readsize; /* read unit of the partition, 0: bufsize */
+    int device; /* index of the first job on the same flash device */
+    int active; /* jobs of this device being written, on the first job */
+    bool started;
+};
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+static void ota_install_throttle(struct ota_install_s* ctx, size_t bytes)
+{
+    if (ctx->throttle) {
+        ota_throttle(ctx->throttle, bytes);
+    }
+}
+#else
+static inline void ota_install_throttle(struct ota_install_s* ctx, size_t bytes)
+{
+}
+#endif
+
+static int64_t ota_install_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int ota_install_percent(struct ota_install_s* ctx, uint64_t bytes)
+{
+    if (ctx->total == 0) {
+        return OTA_PROGRESS_BEGIN;
+    }
+
+    return (int)(OTA_PROGRESS_BEGIN + bytes * (OTA_PROGRESS_END - OTA_PROGRESS_BEGIN) / ctx->total);
+}
+
+/* the progress to publish, taken under ctx->lock and published after it
+ * was dropped, so the workers never wait on KVDB
+ */
+
+struct ota_progress_s {
+    uint32_t seq; /* 0: nothing to publish */
+    int current;
+    int next;
+    int64_t eta;
+};
+
+/* take the bytes written as progress, on every percent but at most once
+ * per CONFIG_UTILS_OTA_INSTALL_PROGRESS_INTERVAL ms otherwise, so the ui
+ * gets the eta without a property set per inflate buffer.
+ * Called with ctx->lock held.
+ */
+
+static void ota_install_progress(struct ota_install_s* ctx, struct ota_progress_s* snap)
+{
+    uint64_t written;
+    int64_t now;
+    int current;
+    int next;
+
+    snap->seq = 0;
+    now = ota_install_now();
+    current = ota_install_percent(ctx, ctx->done);
+
+    /* the progress once the images being written are done */
+
+    next = ota_install_percent(ctx, ctx->started);
+    if (current == ctx->progress && next == ctx->next
+        && now - ctx->published < CONFIG_UTILS_OTA_INSTALL_PROGRESS_INTERVAL) {
+        return;
+    }
+
+    ctx->published = now;
+    ctx->progress = current;
+    ctx->next = next;
+
+    /* seconds left at the rate so far, -1 until anything was written */
+
+    written = ctx->done - ctx->resumed;
+    snap->eta = -1;
+    if (written > 0 && now > ctx->begin) {
+        snap->eta = (int64_t)((ctx->total - ctx->done) * (now - ctx->begin) / written / 1000);
+    }
+
+    snap->seq = ++ctx->seq;
+    snap->current = current;
+    snap->next = next;
+}
+
+/* set the properties of a snapshot without ctx->lock, a snapshot older
+ * than one already published is dropped
+ */
+
+static void ota_install_publish(struct ota_install_s* ctx, const struct ota_progress_s* snap)
+{
+    char buf[24];
+
+    if (snap->seq == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->publish);
+    if ((int32_t)(snap->seq - ctx->publishedseq) <= 0) {
+        pthread_mutex_unlock(&ctx->publish);
+        return;
+    }
+
+    ctx->publishedseq = snap->seq;
+    if (snap->current != ctx->current) {
+        ctx->current = snap->current;
+        snprintf(buf, sizeof(buf), "%d", snap->current);
+        property_set("ota.progress.current", buf);
+    }
+
+    if (snap->next != ctx->publishednext) {
+        ctx->publishednext = snap->next;
+        snprintf(buf, sizeof(buf), "%d", snap->next);
+        property_set("ota.progress.next", buf);
+    }
+
+    snprintf(buf, sizeof(buf), "%" PRId64, snap->eta);
+    property_set("ota.progress.eta", buf);
+    pthread_mutex_unlock(&ctx->publish);
+}
+
+/* an image for a boot slot goes to the slot being updated, the image
+ * it replaces is in the active slot. With virtual A/B the slot being
+ * updated is the snapshot, only registered by the bootloader: the update
+ * is the vela_cow.bin of gen_cow.py, written to the cow partition.
+ */
+
+static int ota_install_slot(struct ota_install_s* ctx, char* path, size_t size,
+    bool update)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+    if (ctx->bootctl) {
+        struct bootctl_slot_info_s info;
+        int i;
+
+        for (i = 0; i < bootctl_slot_num(); i++) {
+            if (bootctl_get(ctx->bootctl, i, &info) == 0 && strcmp(info.name, path) == 0) {
+#ifdef CONFIG_UTILS_BOOTCTL_VIRTUAL_AB
+                if (update) {
+                    OTA_LOG(LOG_ERR, "%s is a virtual A/B slot, package vela_cow.bin instead",
+                        path);
+                    return -EINVAL;
+                }
+#endif
+
+                bootctl_get(ctx->bootctl, update ? bootctl_get_update(ctx->bootctl)
+                                                 : bootctl_get_active(ctx->bootctl), &info);
+                strlcpy(path, info.name, size);
+                break;
+            }
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static bool ota_install_codec(int codec)
+{
+    switch (codec) {
+    case OTA_CODEC_ZIP:
+        return true;
+#ifdef CONFIG_UTILS_OTA_INSTALL_LZ4
+    case OTA_CODEC_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_UTILS_OTA_INSTALL_ZSTD
+    case OTA_CODEC_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* map an entry to its partition: vela_<xxx>.bin -> /dev/<xxx>,
+ * return 0 for entries that are not images, 1 for images.
+ */
+
+static int ota_install_target(struct ota_install_s* ctx, const char* name,
+    char* path, size_t size)
+{
+    size_t len = strlen(name);
+    const char* ext;
+    int ret;
+
+    if (strncmp(name, OTA_IMAGE_PREFIX, strlen(OTA_IMAGE_PREFIX)) != 0
+        || strncmp(name, OTA_IMAGE_SKIP, strlen(OTA_IMAGE_SKIP)) == 0
+        || strchr(name, '/') != NULL || len <= strlen(OTA_IMAGE_PREFIX) + 4) {
+        return 0;
+    }
+
+    ext = name + len - 4;
+    if (strcmp(ext, ".bin") != 0 && strcmp(ext, ".elf") != 0) {
+        return 0;
+    }
+
+    snprintf(path, size, "/dev/%.*s", (int)(ext - name - strlen(OTA_IMAGE_PREFIX)),
+        name + strlen(OTA_IMAGE_PREFIX));
+    ret = ota_install_slot(ctx, path, size, true);
+    return ret < 0 ? ret : 1;
+}
+
+/* index of the CONFIG_UTILS_OTA_INSTALL_DEVICES group listing the
+ * partition, groups are separated by ';' and partitions by ',',
+ * e.g. "ap,ap_b,data;audio". -1: the partition has a device of its own.
+ */
+
+static int ota_install_device(const char* path)
+{
+    const char* devices = CONFIG_UTILS_OTA_INSTALL_DEVICES;
+    const char* name = path;
+    size_t len;
+    int group = 0;
+
+    if (strncmp(name, "/dev/", 5) == 0) {
+        name += 5;
+    }
+
+    len = strlen(name);
+    while (*devices != '\0') {
+        size_t n = strcspn(devices, ",;");
+
+        if (n == len && strncmp(devices, name, len) == 0) {
+            return group;
+        }
+
+        devices += n;
+        if (*devices == ';') {
+            group++;
+        }
+
+        if (*devices != '\0') {
+            devices++;
+        }
+    }
+
+    return -1;
+}
+
+/* add the current entry of zip as an image write, NULL: out of memory */
+
+static struct ota_job_s* ota_install_add(struct ota_install_s* ctx, unzFile zip,
+    const char* name, const char* path, const unz_file_info64* info)
+{
+    struct ota_job_s* job;
+    int group;
+    int i;
+
+    job = realloc(ctx->jobs, (ctx->njobs + 1) * sizeof(*job));
+    if (job == NULL) {
+        return NULL;
+    }
+
+    ctx->jobs = job;
+    job = &ctx->jobs[ctx->njobs];
+    memset(job, 0, sizeof(*job));
+    job->type = OTA_OP_WRITE;
+    strlcpy(job->name, name, sizeof(job->name));
+    strlcpy(job->path, path, sizeof(job->path));
+    job->crc = info->crc;
+    job->csize = info->compressed_size;
+    job->size = info->uncompressed_size;
+    job->stored = zip != NULL && info->compression_method == 0 && !(info->flag & 1);
+    job->device = ctx->njobs;
+    if (zip != NULL) {
+        unzGetFilePos64(zip, &job->pos);
+    }
+
+    group = ota_install_device(path);
+    for (i = 0; group >= 0 && i < ctx->njobs; i++) {
+        if (ota_install_device(ctx->jobs[i].path) == group) {
+            job->device = ctx->jobs[i].device;
+            break;
+        }
+    }
+
+    ctx->njobs++;
+    return job;
+}
+
+/* the sizes and crc of an entry of the zip or the stream */
+
+static int ota_install_info(struct ota_install_s* ctx, unzFile zip, const char* name,
+    unz_file_info64* info)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_STREAM
+    if (ctx->reader != NULL) {
+        return ota_stream_info(ctx->reader, name, info);
+    }
+#endif
+
+    if (unzLocateFile(zip, name, 0) != UNZ_OK
+        || unzGetCurrentFileInfo64(zip, info, NULL, 0, NULL, 0, NULL, 0) != UNZ_OK) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/* a package without ota.manifest: every vela_<xxx>.bin is written */
+
+static int ota_install_scan(struct ota_install_s* ctx, unzFile zip)
+{
+    char name[OTA_PATH_MAX];
+    char path[OTA_PATH_MAX];
+    unz_file_info64 info;
+    int image;
+    int ret;
+
+    for (ret = unzGoToFirstFile(zip); ret == UNZ_OK; ret = unzGoToNextFile(zip)) {
+        ret = unzGetCurrentFileInfo64(zip, &info, name, sizeof(name), NULL, 0, NULL, 0);
+        if (ret != UNZ_OK) {
+            return -EINVAL;
+        }
+
+        image = ota_install_target(ctx, name, path, sizeof(path));
+        if (image < 0) {
+            return image;
+        } else if (image > 0 && ota_install_add(ctx, zip, name, path, &info) == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    return ret == UNZ_END_OF_LIST_OF_FILE ? 0 : -EINVAL;
+}
+
+/* the operations of ota.manifest: writes and deltas become jobs, the
+ * verify keys go to the job writing their target
+ */
+
+static int ota_install_plan(struct ota_install_s* ctx, unzFile zip,
+    const struct ota_manifest_s* manifest, const struct ota_op_s* ops)
+{
+    char path[OTA_PATH_MAX];
+    const struct ota_op_s* op;
+    struct ota_job_s* job;
+    unz_file_info64 info;
+    int32_t version;
+    int ret;
+    int i;
+    int j;
+
+    if (!(manifest->flags & OTA_MANIFEST_SKIP_VERSION_CHECK)) {
+        version = property_get_int32("ro.ota.version", 0);
+        if ((int64_t)manifest->ota_version < version) {
+            OTA_LOG(LOG_ERR, "version %" PRIu32 " is older than %" PRId32,
+                manifest->ota_version, version);
+            return -EPERM;
+        }
+    }
+
+    for (i = 0; i < manifest->nops; i++) {
+        op = &ops[i];
+        if (op->type != OTA_OP_WRITE && op->type != OTA_OP_DELTA) {
+            continue;
+        }
+
+        if (ota_install_info(ctx, zip, op->entry, &info) < 0) {
+            OTA_LOG(LOG_ERR, "%s not found", op->entry);
+            return -ENOENT;
+        }
+
+        /* an lz4 or zstd payload is checked by its zip crc and the image
+         * by the read back crc
+         */
+
+        if (op->type == OTA_OP_WRITE && op->flags == OTA_CODEC_ZIP
+            && (info.crc != op->crc || info.uncompressed_size != op->size)) {
+            OTA_LOG(LOG_ERR, "%s does not match " OTA_MANIFEST_NAME, op->entry);
+            return -EINVAL;
+        }
+
+        if (op->type == OTA_OP_WRITE && !ota_install_codec(op->flags)) {
+            OTA_LOG(LOG_ERR, "%s: codec %d is not enabled", op->entry, op->flags);
+            return -ENOTSUP;
+        }
+
+        strlcpy(path, op->target, sizeof(path));
+        ret = ota_install_slot(ctx, path, sizeof(path), true);
+        if (ret < 0) {
+            return ret;
+        }
+
+        job = ota_install_add(ctx, zip, op->entry, path, &info);
+        if (job == NULL) {
+            return -ENOMEM;
+        }
+
+        /* a delta writes the new image, not the patch */
+
+        job->type = op->type;
+        job->codec = op->type == OTA_OP_WRITE ? op->flags : OTA_CODEC_ZIP;
+        job->stored = job->stored && job->codec == OTA_CODEC_ZIP && op->type == OTA_OP_WRITE;
+        job->crc = op->crc;
+        job->size = op->size;
+        if (op->type != OTA_OP_DELTA) {
+            continue;
+        }
+
+#ifndef CONFIG_UTILS_OTA_INSTALL_DELTA
+        OTA_LOG(LOG_ERR, "%s needs CONFIG_UTILS_OTA_INSTALL_DELTA", op->entry);
+        return -ENOTSUP;
+#endif
+
+        /* the patch reads the old image while the new one is written */
+
+        strlcpy(job->source, op->target, sizeof(job->source));
+        ota_install_slot(ctx, job->source, sizeof(job->source), false);
+        if (strcmp(job->source, job->path) == 0) {
+            OTA_LOG(LOG_ERR, "%s: %s can not be patched in place", op->entry, job->path);
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < manifest->nops; i++) {
+        op = &ops[i];
+        if (op->type != OTA_OP_VERIFY) {
+            continue;
+        }
+
+#ifndef CONFIG_UTILS_OTA_INSTALL_VERIFY
+        OTA_LOG(LOG_ERR, "verify %s needs CONFIG_UTILS_OTA_INSTALL_VERIFY", op->target);
+        return -ENOTSUP;
+#endif
+
+        strlcpy(path, op->target, sizeof(path));
+        ret = ota_install_slot(ctx, path, sizeof(path), true);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < ctx->njobs && strcmp(ctx->jobs[j].path, path) != 0; j++) {
+        }
+
+        if (j == ctx->njobs) {
+            OTA_LOG(LOG_ERR, "verify %s, which is not written", op->target);
+            return -EINVAL;
+        }
+
+        strlcpy(ctx->jobs[j].key, op->entry, sizeof(ctx->jobs[j].key));
+    }
+
+    return 0;
+}
+
+int ota_install_unzread(void* zip, uint8_t* buf, size_t len)
+{
+    int ret;
+
+    ret = unzReadCurrentFile(zip, buf, len);
+    return ret < 0 ? -EIO : ret;
+}
+
+/* open an entry for src: the zip entry at pos, or found by name, or the
+ * entry of the stream, which must not be behind its position
+ */
+
+static int ota_install_enter(struct ota_install_s* ctx, unzFile zip, const char* name,
+    const unz64_file_pos* pos, struct ota_src_s* src)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_STREAM
+    if (ctx->reader != NULL) {
+        src->read = ota_stream_read;
+        src->handle = ctx->reader;
+        return ota_stream_next(ctx->reader, name);
+    }
+#endif
+
+    src->read = ota_install_unzread;
+    src->handle = zip;
+    if ((pos ? unzGoToFilePos64(zip, pos) : unzLocateFile(zip, name, 0)) != UNZ_OK
+        || unzOpenCurrentFile(zip) != UNZ_OK) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/* the zip checks the crc here, the stream on the last read */
+
+static int ota_install_leave(struct ota_install_s* ctx, unzFile zip)
+{
+    if (ctx->reader != NULL) {
+        return 0;
+    }
+
+    return unzCloseCurrentFile(zip) == UNZ_OK ? 0 : -EILSEQ;
+}
+
+#ifdef CONFIG_SYSTEM_SYSTEM
+static int ota_install_extract(struct ota_install_s* ctx, unzFile zip, const char* name,
+    const char* path)
+{
+    struct ota_src_s src;
+    uint8_t buf[256];
+    int ret;
+    int fd;
+
+    ret = ota_install_enter(ctx, zip, name, NULL, &src);
+    if (ret < 0) {
+        return ret;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        ota_install_leave(ctx, zip);
+        return ret;
+    }
+
+    while ((ret = src.read(src.handle, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, ret) != ret) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    if (close(fd) < 0 && ret == 0) {
+        ret = -errno;
+    }
+
+    if (ota_install_leave(ctx, zip) < 0 && ret == 0) {
+        ret = -EILSEQ;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+#endif
+
+/* run the begin or end scripts of the manifest. They are the only part
+ * of the plan that needs nsh, a script is extracted and run with sh.
+ */
+
+static int ota_install_hooks(struct ota_install_s* ctx, unzFile zip,
+    const struct ota_manifest_s* manifest, const struct ota_op_s* ops, int when)
+{
+#ifdef CONFIG_SYSTEM_SYSTEM
+    char path[OTA_PATH_MAX];
+    char cmd[OTA_PATH_MAX + 4];
+    int ret;
+#endif
+    const struct ota_op_s* op;
+    int i;
+
+    for (i = 0; i < manifest->nops; i++) {
+        op = &ops[i];
+        if (op->type != OTA_OP_HOOK || op->flags != when) {
+            continue;
+        }
+
+#ifdef CONFIG_SYSTEM_SYSTEM
+        snprintf(path, sizeof(path), CONFIG_UTILS_OTA_INSTALL_TMPDIR "/%s", op->entry);
+        ret = ota_install_extract(ctx, zip, op->entry, path);
+        if (ret < 0) {
+            OTA_LOG(LOG_ERR, "extract %s failed, ret: %d", op->entry, ret);
+            return ret;
+        }
+
+        OTA_LOG(LOG_INFO, "run %s", op->entry);
+        snprintf(cmd, sizeof(cmd), "sh %s", path);
+        ret = system(cmd);
+        unlink(path);
+        if (ret != 0) {
+            OTA_LOG(LOG_ERR, "%s failed, ret: %d", op->entry, ret);
+            return -EPERM;
+        }
+#else
+        OTA_LOG(LOG_ERR, "%s needs CONFIG_SYSTEM_SYSTEM", op->entry);
+        return -ENOTSUP;
+#endif
+    }
+
+    return 0;
+}
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_CHECKPOINT
+static void ota_ckpt_key(const struct ota_job_s* job, char* key, size_t size)
+{
+    const char* name = strrchr(job->path, '/');
+
+    snprintf(key, size, OTA_CKPT_PREFIX "%s", name ? name + 1 : job->path);
+}
+
+/* bytes of the image already written by an interrupted install of the
+ * same entry, 0: start over
+ */
+
+static uint64_t ota_ckpt_load(struct ota_install_s* ctx, const struct ota_job_s* job)
+{
+    char key[PROP_NAME_MAX];
+    struct ota_ckpt_s ckpt;
+    ssize_t ret;
+
+    ota_ckpt_key(job, key, sizeof(key));
+    pthread_mutex_lock(&ctx->lock);
+    ret = property_get_buffer(key, &ckpt, sizeof(ckpt));
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (ret != sizeof(ckpt) || ckpt.crc != job->crc || ckpt.csize != job->csize
+        || ckpt.size != job->size || ckpt.offset > job->size) {
+        return 0;
+    }
+
+    return ckpt.offset;
+}
+
+static int ota_ckpt_store(struct ota_install_s* ctx, const struct ota_job_s* job,
+    uint64_t offset)
+{
+    char key[PROP_NAME_MAX];
+    struct ota_ckpt_s ckpt;
+    int ret;
+
+    memset(&ckpt, 0, sizeof(ckpt));
+    ckpt.crc = job->crc;
+    ckpt.csize = job->csize;
+    ckpt.size = job->size;
+    ckpt.offset = offset;
+
+    ota_ckpt_key(job, key, sizeof(key));
+    pthread_mutex_lock(&ctx->lock);
+    ret = property_set_buffer(key, &ckpt, sizeof(ckpt));
+    if (ret >= 0) {
+        ret = property_commit();
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "checkpoint %s failed, ret: %d", key, ret);
+    }
+
+    return ret;
+}
+
+/* called once the install succeeded, committed with the progress */
+
+static void ota_ckpt_clear(struct ota_install_s* ctx)
+{
+    char key[PROP_NAME_MAX];
+    int i;
+
+    for (i = 0; i < ctx->njobs; i++) {
+        ota_ckpt_key(&ctx->jobs[i], key, sizeof(key));
+        property_delete(key);
+    }
+}
+
+/* sync the image written so far, then record it, every
+ * CONFIG_UTILS_OTA_INSTALL_CHECKPOINT_BLOCKS erase blocks. The end of
+ * the image is only recorded by ota_install_job() once it was verified.
+ */
+
+static int ota_ckpt_update(struct ota_install_s* ctx, const struct ota_job_s* job,
+    struct ota_part_s* part, uint64_t* last)
+{
+    int ret;
+
+    if (part->offset < *last + (uint64_t)part->blocksize * CONFIG_UTILS_OTA_INSTALL_CHECKPOINT_BLOCKS
+        || part->offset >= job->size) {
+        return 0;
+    }
+
+    ret = ota_part_sync(part);
+    if (ret >= 0) {
+        ret = ota_ckpt_store(ctx, job, part->offset);
+    }
+
+    *last = part->offset;
+    return ret;
+}
+#else
+static inline uint64_t ota_ckpt_load(struct ota_install_s* ctx, const struct ota_job_s* job)
+{
+    return 0;
+}
+
+static inline int ota_ckpt_store(struct ota_install_s* ctx, const struct ota_job_s* job,
+    uint64_t offset)
+{
+    return 0;
+}
+
+static inline void ota_ckpt_clear(struct ota_install_s* ctx) { }
+
+static inline int ota_ckpt_update(struct ota_install_s* ctx, const struct ota_job_s* job,
+    struct ota_part_s* part, uint64_t* last)
+{
+    return 0;
+}
+#endif
+
+/* the image is inflated by the zip, made from a patch entry and the old
+ * image, decoded from an lz4 or zstd payload entry, or read as stored
+ */
+
+static int ota_install_open(struct ota_install_s* ctx, unzFile zip,
+    const struct ota_src_s* src, union ota_stream_u* stream, const struct ota_job_s* job)
+{
+    if (job->stored) {
+        return ota_stored_open(&stream->stored, ctx->package,
+            unzGetCurrentFileZStreamPos64(zip), job->size, job->crc);
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_DELTA
+    if (job->type == OTA_OP_DELTA) {
+        OTA_LOG(LOG_INFO, "patch %s with %s", job->source, job->name);
+        return ota_delta_open(&stream->delta, src, job->source, job->size, ctx->bufsize);
+    }
+#endif
+
+#ifdef OTA_INSTALL_CODEC
+    if (job->codec != OTA_CODEC_ZIP) {
+        return ota_codec_open(&stream->codec, src, job->codec, ctx->bufsize);
+    }
+#endif
+
+    return 0;
+}
+
+/* the next bytes of the image at *data, in buf or mapped from the package */
+
+static int ota_install_read(struct ota_install_s* ctx, const struct ota_src_s* src,
+    union ota_stream_u* stream, uint8_t* buf, const struct ota_job_s* job,
+    const uint8_t** data)
+{
+    int ret;
+
+    *data = buf;
+    if (job->stored) {
+        return ota_stored_read(&stream->stored, buf, ctx->bufsize, data);
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_DELTA
+    if (job->type == OTA_OP_DELTA) {
+        return ota_delta_read(&stream->delta, buf, ctx->bufsize);
+    }
+#endif
+
+#ifdef OTA_INSTALL_CODEC
+    if (job->codec != OTA_CODEC_ZIP) {
+        return ota_codec_read(&stream->codec, buf, ctx->bufsize);
+    }
+#endif
+
+    ret = src->read(src->handle, buf, ctx->bufsize);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "inflate %s failed, ret: %d", job->name, ret);
+    }
+
+    return ret;
+}
+
+static void ota_install_close(union ota_stream_u* stream, const struct ota_job_s* job)
+{
+    if (job->stored) {
+        ota_stored_close(&stream->stored);
+    }
+#ifdef CONFIG_UTILS_OTA_INSTALL_DELTA
+    if (job->type == OTA_OP_DELTA) {
+        ota_delta_close(&stream->delta);
+    }
+#endif
+
+#ifdef OTA_INSTALL_CODEC
+    if (job->codec != OTA_CODEC_ZIP) {
+        ota_codec_close(&stream->codec);
+    }
+#endif
+}
+
+static int ota_install_entry(struct ota_install_s* ctx, unzFile zip,
+    uint8_t* buf, struct ota_job_s* job, uint64_t resume)
+{
+    union ota_stream_u stream;
+    struct ota_progress_s snap;
+    struct ota_part_s part;
+    struct ota_src_s src;
+    const uint8_t* data;
+    uint64_t last = resume;
+    uint64_t skip = resume;
+    int64_t start;
+    size_t len;
+    size_t off;
+    int ret;
+
+    if (resume > 0) {
+        OTA_LOG(LOG_INFO, "resume %s to %s at %" PRIu64, job->name, job->path, resume);
+    } else {
+        OTA_LOG(LOG_INFO, "install %s to %s", job->name, job->path);
+    }
+
+    start = ota_install_now();
+    ret = ota_install_enter(ctx, zip, job->name, &job->pos, &src);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", job->name, ret);
+        return ret;
+    }
+
+    ret = ota_install_open(ctx, zip, &src, &stream, job);
+    if (ret < 0) {
+        ota_install_leave(ctx, zip);
+        return ret;
+    }
+
+    ret = ota_part_open(&part, job->path, resume);
+    if (ret < 0) {
+        goto out;
+    }
+
+    job->readsize = part.readsize;
+
+    for (; ; ) {
+        ret = ota_install_read(ctx, &src, &stream, buf, job, &data);
+        if (ret <= 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->done += ret;
+        ota_install_progress(ctx, &snap);
+
+        /* another image failed, the install is lost anyway */
+
+        if (ctx->error < 0) {
+            ret = -ECANCELED;
+        }
+
+        pthread_mutex_unlock(&ctx->lock);
+        ota_install_publish(ctx, &snap);
+
+        if (ret < 0) {
+            break;
+        }
+
+        /* a deflated entry can only be resumed by inflating it again,
+         * the part already on the flash is dropped here
+         */
+
+        len = ret;
+        off = 0;
+        if (skip > 0) {
+            off = skip < len ? skip : len;
+            skip -= off;
+        }
+
+        ret = ota_part_write(&part, data + off, len - off);
+        if (ret >= 0) {
+            ret = ota_ckpt_update(ctx, job, &part, &last);
+        }
+
+        if (ret < 0) {
+            break;
+        }
+
+        ota_install_throttle(ctx, len - off);
+    }
+
+    ota_install_close(&stream, job);
+
+    /* the entry crc is checked once the whole entry was read, before the
+     * last partial block is programmed
+     */
+
+    if (ota_install_leave(ctx, zip) < 0 && ret >= 0) {
+        OTA_LOG(LOG_ERR, "%s crc mismatch", job->name);
+        ret = -EILSEQ;
+    }
+
+    if (ret < 0) {
+        ota_part_close(&part, true);
+        return ret;
+    }
+
+    ret = ota_part_close(&part, false);
+    if (ret >= 0) {
+        OTA_LOG(LOG_INFO, "%s: %zu blocks written, %zu unchanged, %" PRId64 " ms", job->path,
+            part.blocks - part.skipped, part.skipped, ota_install_now() - start);
+    }
+
+    return ret;
+
+out:
+    ota_install_close(&stream, job);
+    ota_install_leave(ctx, zip);
+    return ret;
+}
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_VERIFY
+static int ota_install_avb(const char* path, const char* key)
+{
+    int ret;
+
+    /* as "avb_verify -c": the new slot has not booted yet, its rollback
+     * index is stored by the verified boot of that slot, not here
+     */
+
+    ret = avb_verify(path, key, NULL,
+        AVB_SLOT_VERIFY_FLAGS_NOT_ALLOW_SAME_ROLLBACK_INDEX
+            | AVB_SLOT_VERIFY_FLAGS_NOT_UPDATE_ROLLBACK_INDEX);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+        OTA_LOG(LOG_ERR, "verify %s failed, ret: %d", path, ret);
+        return -EPERM;
+    }
+
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_READBACK
+
+/* read the image back in one pass, its crc must be the crc of the zip
+ * entry, which minizip checked while the entry was inflated
+ */
+
+static int ota_install_readback(struct ota_install_s* ctx, const struct ota_job_s* job,
+    uint8_t* buf)
+{
+    size_t unit = job->readsize > 0 && job->readsize < ctx->bufsize ? job->readsize : ctx->bufsize;
+    uint64_t done = 0;
+    uLong crc = crc32(0, Z_NULL, 0);
+    ssize_t ret;
+    size_t len;
+    int fd;
+
+    fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %zd", job->path, ret);
+        return ret;
+    }
+
+    while (done < job->size) {
+        len = job->size - done < unit ? job->size - done : unit;
+        ret = read(fd, buf, len);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            ret = ret < 0 ? -errno : -EIO;
+            OTA_LOG(LOG_ERR, "read %s at %" PRIu64 " failed, ret: %zd", job->path, done, ret);
+            close(fd);
+            return ret;
+        }
+
+        crc = crc32(crc, buf, ret);
+        done += ret;
+        ota_install_throttle(ctx, ret);
+    }
+
+    close(fd);
+    if (crc != job->crc) {
+        OTA_LOG(LOG_ERR, "%s read back crc %08lx, expected %08" PRIx32, job->path,
+            (unsigned long)crc, job->crc);
+        return -EILSEQ;
+    }
+
+    return 0;
+}
+#endif
+
+/* check what landed on the partition. With a key, avb reads the image
+ * once against its signed hash descriptor, which covers the write as
+ * well, so there is no separate read back.
+ */
+
+static int ota_install_verify(struct ota_install_s* ctx, const struct ota_job_s* job,
+    uint8_t* buf)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_VERIFY
+    const char* key = job->key[0] != '\0' ? job->key : ctx->key;
+
+    if (key) {
+        return ota_install_avb(job->path, key);
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_READBACK
+    return ota_install_readback(ctx, job, buf);
+#else
+    return 0;
+#endif
+}
+
+static int ota_install_job(struct ota_install_s* ctx, unzFile zip,
+    uint8_t* buf, struct ota_job_s* job)
+{
+    struct ota_progress_s snap;
+    uint64_t resume;
+    int ret;
+
+    /* written and verified before the power loss */
+
+    resume = ota_ckpt_load(ctx, job);
+    if (resume == job->size && job->size > 0) {
+        OTA_LOG(LOG_INFO, "%s already installed to %s", job->name, job->path);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->done += job->size;
+        ctx->resumed += job->size;
+        ota_install_progress(ctx, &snap);
+        pthread_mutex_unlock(&ctx->lock);
+        ota_install_publish(ctx, &snap);
+        return 0;
+    }
+
+    ret = ota_install_entry(ctx, zip, buf, job, resume);
+    if (ret >= 0) {
+        ret = ota_install_verify(ctx, job, buf);
+    }
+
+    /* blocks are checkpointed before the entry is checked, a corrupted
+     * download must not be resumed from
+     */
+
+    if (ret == -EILSEQ || ret == -EPERM) {
+        ota_ckpt_store(ctx, job, 0);
+    } else if (ret >= 0) {
+        ret = ota_ckpt_store(ctx, job, job->size);
+    }
+
+    return ret;
+}
+
+/* the next image whose flash device has a free write slot, NULL when
+ * every image is started. Called with ctx->lock held.
+ */
+
+static struct ota_job_s* ota_install_next(struct ota_install_s* ctx, bool* pending)
+{
+    struct ota_job_s* job;
+    int i;
+
+    *pending = false;
+    for (i = 0; i < ctx->njobs; i++) {
+        job = &ctx->jobs[i];
+        if (job->started) {
+            continue;
+        }
+
+        *pending = true;
+        if (ctx->jobs[job->device].active < CONFIG_UTILS_OTA_INSTALL_DEVICE_JOBS) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void* ota_install_worker(void* arg)
+{
+    struct ota_install_s* ctx = arg;
+    struct ota_progress_s snap;
+    struct ota_job_s* job;
+    uint8_t* buf;
+    unzFile zip;
+    bool pending;
+    int ret = 0;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+    if (ctx->throttle) {
+        ota_throttle_join(ctx->throttle);
+    }
+#endif
+
+    zip = ctx->reader == NULL ? unzOpen64(ctx->package) : NULL;
+    buf = malloc(ctx->bufsize);
+    if ((zip == NULL && ctx->reader == NULL) || buf == NULL) {
+        OTA_LOG(LOG_ERR, "worker init failed");
+        ret = -ENOMEM;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ret < 0 && ctx->error == 0) {
+        ctx->error = ret;
+    }
+
+    while (ctx->error == 0) {
+        job = ota_install_next(ctx, &pending);
+        if (job == NULL) {
+            if (!pending) {
+                break;
+            }
+
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+            continue;
+        }
+
+        job->started = true;
+        ctx->jobs[job->device].active++;
+        ctx->started += job->size;
+        ota_install_progress(ctx, &snap);
+        pthread_mutex_unlock(&ctx->lock);
+        ota_install_publish(ctx, &snap);
+
+        ret = ota_install_job(ctx, zip, buf, job);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->jobs[job->device].active--;
+        if (ret < 0 && ctx->error == 0) {
+            ctx->error = ret;
+        }
+
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    free(buf);
+    if (zip != NULL) {
+        unzClose(zip);
+    }
+
+    return NULL;
+}
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_TUNE
+
+/* measure the partitions written for the first time one after the other
+ * before any worker starts, so the other writes do not skew the sizes
+ * kept. A resumed partition holds a part of the image, it is not rewritten.
+ */
+
+static void ota_install_tune(struct ota_install_s* ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->njobs; i++) {
+        if (ota_ckpt_load(ctx, &ctx->jobs[i]) == 0) {
+            ota_tune_calibrate(ctx->jobs[i].path);
+        }
+    }
+}
+#else
+static inline void ota_install_tune(struct ota_install_s* ctx) { }
+#endif
+
+/* run the workers, the calling task is one of them */
+
+static int ota_install_run(struct ota_install_s* ctx)
+{
+    pthread_t threads[CONFIG_UTILS_OTA_INSTALL_WORKERS];
+    pthread_attr_t attr;
+    int nthreads = 0;
+    int ret;
+
+    ota_install_tune(ctx);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONFIG_UTILS_OTA_INSTALL_STACKSIZE);
+
+    /* the calling task is a worker too, the helpers of ota_pipe inherit */
+
+    if (ctx->priority > 0) {
+        struct sched_param param;
+
+        param.sched_priority = ctx->priority;
+        pthread_attr_setschedparam(&attr, &param);
+        sched_setparam(0, &param);
+    }
+
+    while (nthreads < ctx->workers - 1 && nthreads < ctx->njobs - 1) {
+        ret = pthread_create(&threads[nthreads], &attr, ota_install_worker, ctx);
+        if (ret != 0) {
+            OTA_LOG(LOG_WARNING, "create worker failed, ret: %d", ret);
+            break;
+        }
+
+        nthreads++;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    ota_install_worker(ctx);
+    while (nthreads > 0) {
+        pthread_join(threads[--nthreads], NULL);
+    }
+
+    return ctx->error;
+}
+
+int ota_install(struct ota_install_s* ctx)
+{
+    struct ota_manifest_s manifest;
+    struct ota_op_s* ops = NULL;
+    unzFile zip = NULL;
+    int ret;
+    int i;
+
+    if (ctx->workers < 1 || ctx->workers > CONFIG_UTILS_OTA_INSTALL_WORKERS) {
+        return -EINVAL;
+    }
+
+    ctx->reader = NULL;
+    if (ctx->stream) {
+#ifdef CONFIG_UTILS_OTA_INSTALL_STREAM
+
+        /* the signed header is checked before anything is written, the
+         * entries are read once in their order
+         */
+
+        ret = ota_stream_open(&ctx->reader, ctx->package, CONFIG_UTILS_OTA_INSTALL_STREAM_KEY,
+            ctx->bufsize, &manifest, &ops);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ctx->workers = 1;
+#else
+        return -ENOTSUP;
+#endif
+    } else {
+        zip = unzOpen64(ctx->package);
+        if (zip == NULL) {
+            OTA_LOG(LOG_ERR, "open %s failed", ctx->package);
+            return -ENOENT;
+        }
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->publish, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->jobs = NULL;
+    ctx->njobs = 0;
+    ctx->total = 0;
+    ctx->started = 0;
+    ctx->done = 0;
+    ctx->resumed = 0;
+    ctx->begin = ota_install_now();
+    ctx->published = ctx->begin;
+    ctx->progress = -1;
+    ctx->next = -1;
+    ctx->seq = 0;
+    ctx->publishedseq = 0;
+    ctx->current = -1;
+    ctx->publishednext = -1;
+    ctx->error = 0;
+
+    /* the whole plan is known before anything is written */
+
+    ret = ctx->reader != NULL ? 0 : ota_manifest_load(zip, &manifest, &ops);
+    if (ret == -ENOENT) {
+        manifest.nops = 0;
+        ret = ota_install_scan(ctx, zip);
+    } else if (ret >= 0) {
+        ret = ota_install_plan(ctx, zip, &manifest, ops);
+    }
+
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < ctx->njobs; i++) {
+        ctx->total += ctx->jobs[i].size;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+
+    /* the slot must be unbootable before it is written */
+
+    if (ctx->bootctl) {
+        ret = bootctl_mark_update(ctx->bootctl);
+        if (ret >= 0) {
+            ret = bootctl_commit(ctx->bootctl, 0);
+        }
+
+        if (ret < 0) {
+            OTA_LOG(LOG_ERR, "bootctl update failed, ret: %d", ret);
+            goto out;
+        }
+    }
+#endif
+
+    ret = ota_install_hooks(ctx, zip, &manifest, ops, OTA_HOOK_BEGIN);
+    if (ret >= 0) {
+        ret = ota_install_run(ctx);
+    }
+
+    if (ret >= 0) {
+        ret = ota_install_hooks(ctx, zip, &manifest, ops, OTA_HOOK_END);
+    }
+
+    if (ret < 0) {
+        goto out;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+
+    /* boot the new slot next, committed together with the progress */
+
+    if (ctx->bootctl) {
+        ret = bootctl_mark_done(ctx->bootctl);
+        if (ret >= 0) {
+            ret = bootctl_commit(ctx->bootctl, BOOTCTL_COMMIT_NOSYNC);
+        }
+    }
+#endif
+
+    if (ret >= 0) {
+        ota_ckpt_clear(ctx);
+    }
+
+out:
+    property_set("ota.progress.current", ret < 0 ? "-1" : "100");
+    property_set("ota.progress.eta", ret < 0 ? "-1" : "0");
+    property_commit();
+    free(ops);
+    free(ctx->jobs);
+    ctx->jobs = NULL;
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->publish);
+    pthread_mutex_destroy(&ctx->lock);
+#ifdef CONFIG_UTILS_OTA_INSTALL_STREAM
+    if (ctx->reader != NULL) {
+        ota_stream_close(ctx->reader);
+        ctx->reader = NULL;
+    }
+#endif
+
+    if (zip != NULL) {
+        unzClose(zip);
+    }
+
+    return ret;
+}
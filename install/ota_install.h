@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INSTALL_OTA_INSTALL_H
+#define INSTALL_OTA_INSTALL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unzip.h>
+
+#define OTA_LOG(l, f, ...) syslog(l, "ota_install: " f "\n", ##__VA_ARGS__)
+
+#define OTA_PATH_MAX 64
+
+#define OTA_PROGRESS_BEGIN 30
+#define OTA_PROGRESS_END 100
+
+#if defined(CONFIG_UTILS_OTA_INSTALL_LZ4) || defined(CONFIG_UTILS_OTA_INSTALL_ZSTD)
+#define OTA_INSTALL_CODEC
+#endif
+
+/* ota.manifest, the install plan generated by gen_ota_zip.py. The header
+ * is followed by nops operations, all little endian. It is covered by the
+ * package signature like every other entry of ota.zip.
+ */
+
+#define OTA_MANIFEST_NAME "ota.manifest"
+#define OTA_MANIFEST_MAGIC 0x4e414d56 /* "VMAN" */
+#define OTA_MANIFEST_VERSION 1
+#define OTA_MANIFEST_NAME_MAX 32
+
+#define OTA_MANIFEST_SKIP_VERSION_CHECK (1 << 0)
+
+enum ota_op_e {
+    OTA_OP_WRITE = 1, /* write entry to target */
+    OTA_OP_DELTA, /* apply the ddelta patch entry to target */
+    OTA_OP_VERIFY, /* avb verify target with the key in entry */
+    OTA_OP_HOOK, /* run the script entry, flags: begin or end */
+};
+
+enum ota_hook_e {
+    OTA_HOOK_BEGIN,
+    OTA_HOOK_END,
+};
+
+/* flags of OTA_OP_WRITE, how the entry is encoded */
+
+enum ota_codec_e {
+    OTA_CODEC_ZIP, /* the image, deflated or stored by the zip */
+    OTA_CODEC_LZ4, /* a stored lz4 frame of the image */
+    OTA_CODEC_ZSTD, /* a stored zstd frame of the image */
+};
+
+struct ota_manifest_s {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nops;
+    uint32_t ota_version; /* must not be below ro.ota.version */
+    uint32_t flags;
+    uint64_t total; /* bytes written by all write and delta operations */
+    uint32_t opscrc; /* crc32 of the operations */
+    uint32_t crc; /* crc32 of the fields before it */
+};
+
+struct ota_op_s {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t crc; /* crc32 of the image written */
+    uint64_t size; /* bytes of the image written */
+    char entry[OTA_MANIFEST_NAME_MAX];
+    char target[OTA_MANIFEST_NAME_MAX];
+};
+
+/* ota.stream, a package that is read once in install order, e.g. from a
+ * pipe while it is being downloaded. All little endian:
+ *
+ *   header | ota.manifest | entry table | signature | entry data ...
+ *
+ * The signature is RSA2048 over the sha256 of everything before it and
+ * is checked before anything is written. The table holds the sha256 of
+ * every entry, which is checked once the entry was read to its end, like
+ * the crc of a zip entry.
+ */
+
+#define OTA_STREAM_MAGIC 0x52545356 /* "VSTR" */
+#define OTA_STREAM_VERSION 1
+#define OTA_STREAM_SIG_MAX 512
+
+struct ota_stream_header_s {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nentries;
+    uint32_t siglen; /* bytes of the signature */
+    uint32_t reserved;
+};
+
+struct ota_stream_entry_s {
+    char name[OTA_MANIFEST_NAME_MAX];
+    uint8_t method; /* 0: stored, 8: deflated, as in zip */
+    uint8_t reserved[3];
+    uint32_t crc; /* crc32 of the entry, as in zip */
+    uint64_t csize; /* bytes in the stream */
+    uint64_t size;
+    uint8_t digest[32]; /* sha256 of the bytes in the stream */
+};
+
+struct bootctl_handle_s;
+struct mtd_geometry_s;
+struct ota_job_s;
+struct ota_pipe_s;
+struct ota_stream_s;
+struct ota_throttle_s;
+
+/* where a payload is read from: the open zip entry or the current entry
+ * of an ota stream. read returns the bytes read, 0 at the end of the
+ * entry once its crc or digest matched.
+ */
+
+struct ota_src_s {
+    int (*read)(void* handle, uint8_t* buf, size_t len);
+    void* handle;
+};
+
+/* One target partition, written in whole erase blocks */
+
+struct ota_part_s {
+    int fd;
+    char path[OTA_PATH_MAX];
+    size_t blocksize; /* erase block size or a multiple, the write unit */
+    size_t readsize; /* read unit, 0: all at once */
+    uint8_t* buf; /* one write unit being filled */
+    size_t fill;
+    off_t offset; /* partition offset of buf */
+    size_t blocks; /* blocks flushed */
+    size_t skipped; /* blocks already on the partition, not written */
+#ifdef CONFIG_UTILS_OTA_INSTALL_SKIP_UNCHANGED
+    uint8_t* cmp; /* the block read back from the partition */
+#endif
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    struct ota_pipe_s* pipe; /* erase-ahead mtd writes, NULL: write() to fd */
+#endif
+};
+
+struct ota_delta_s {
+    struct ota_src_s src; /* the patch entry */
+    int fd; /* the old image */
+    uint8_t* old;
+    off_t pos; /* in the old image */
+    uint64_t size; /* of the new image */
+    uint64_t written;
+    uint64_t diff; /* bytes left in the current patch entry */
+    uint64_t extra;
+    int64_t seek;
+    bool end;
+};
+
+struct ota_codec_s {
+    struct ota_src_s src; /* the payload entry */
+    int type;
+    uint8_t* in;
+    size_t insize;
+    size_t inpos;
+    size_t inlen;
+    bool end;
+    struct LZ4F_dctx_s* lz4;
+    struct ZSTD_DCtx_s* zstd;
+};
+
+struct ota_stored_s {
+    int fd; /* the package */
+    off_t offset; /* of the entry data */
+    uint64_t size;
+    uint64_t pos;
+    uint32_t crc;
+    uint32_t want;
+    const uint8_t* map; /* the entry in place (XIP), NULL: pread() */
+};
+
+struct ota_install_s {
+    const char* package;
+    const char* key; /* avb key(s) to verify the written images, NULL: skip */
+    struct bootctl_handle_s* bootctl; /* NULL: install to /dev/<xxx> as named */
+    size_t bufsize; /* inflate buffer of each worker */
+    int workers; /* images written at the same time */
+    int priority; /* of the workers, 0: unchanged */
+    bool stream; /* package is an ota.stream, "-": stdin */
+    struct ota_throttle_s* throttle; /* background install, NULL: full speed */
+
+    /* shared by the workers, under lock */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ota_stream_s* reader; /* the open ota.stream, NULL: a zip */
+    struct ota_job_s* jobs;
+    int njobs;
+    uint64_t total; /* uncompressed bytes of all images */
+    uint64_t started; /* bytes of the images started so far */
+    uint64_t done;
+    uint64_t resumed; /* bytes skipped by checkpoints, left out of the eta */
+    int64_t begin; /* ms */
+    int64_t published; /* ms, last progress taken */
+    int progress; /* ota.progress.current last taken */
+    int next; /* ota.progress.next last taken */
+    uint32_t seq; /* progress snapshots taken */
+    int error; /* first failure, stops the other workers */
+
+    /* the properties set, under publish, which is never held with lock */
+
+    pthread_mutex_t publish;
+    uint32_t publishedseq;
+    int current; /* last ota.progress.current set */
+    int publishednext; /* last ota.progress.next set */
+};
+
+int ota_part_open(struct ota_part_s* part, const char* path, off_t offset);
+int ota_part_write(struct ota_part_s* part, const uint8_t* data, size_t size);
+int ota_part_sync(struct ota_part_s* part);
+int ota_part_close(struct ota_part_s* part, bool abort);
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+int ota_pipe_depth(const char* path);
+int ota_pipe_open(struct ota_pipe_s** ppipe, const char* path, int depth,
+    size_t* erasesize);
+int ota_pipe_read(struct ota_pipe_s* pipe, uint8_t* buf, size_t len, off_t offset);
+int ota_pipe_push(struct ota_pipe_s* pipe, uint8_t** buf, size_t len, off_t offset);
+int ota_pipe_drain(struct ota_pipe_s* pipe);
+int ota_pipe_close(struct ota_pipe_s* pipe);
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_TUNE
+int ota_tune(const char* path, const struct mtd_geometry_s* geo, size_t* writesize,
+    size_t* readsize);
+int ota_tune_calibrate(const char* path);
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+int ota_throttle_open(struct ota_throttle_s** pthrottle, size_t rate);
+void ota_throttle_join(struct ota_throttle_s* throttle);
+void ota_throttle(struct ota_throttle_s* throttle, size_t bytes);
+void ota_throttle_close(struct ota_throttle_s* throttle);
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_DELTA
+int ota_delta_open(struct ota_delta_s* delta, const struct ota_src_s* src,
+    const char* path, uint64_t size, size_t bufsize);
+ssize_t ota_delta_read(struct ota_delta_s* delta, uint8_t* buf, size_t len);
+void ota_delta_close(struct ota_delta_s* delta);
+#endif
+
+#ifdef OTA_INSTALL_CODEC
+int ota_codec_open(struct ota_codec_s* codec, const struct ota_src_s* src, int type,
+    size_t bufsize);
+ssize_t ota_codec_read(struct ota_codec_s* codec, uint8_t* buf, size_t len);
+void ota_codec_close(struct ota_codec_s* codec);
+#endif
+
+int ota_stored_open(struct ota_stored_s* stored, const char* package, off_t offset,
+    uint64_t size, uint32_t crc);
+ssize_t ota_stored_read(struct ota_stored_s* stored, uint8_t* buf, size_t len,
+    const uint8_t** data);
+void ota_stored_close(struct ota_stored_s* stored);
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_STREAM
+int ota_stream_open(struct ota_stream_s** pstream, const char* path, const char* key,
+    size_t bufsize, struct ota_manifest_s* manifest, struct ota_op_s** ops);
+int ota_stream_info(struct ota_stream_s* stream, const char* name, unz_file_info64* info);
+int ota_stream_next(struct ota_stream_s* stream, const char* name);
+int ota_stream_read(void* handle, uint8_t* buf, size_t len);
+void ota_stream_close(struct ota_stream_s* stream);
+#endif
+
+int ota_manifest_read(const struct ota_src_s* src, struct ota_manifest_s* manifest,
+    struct ota_op_s** ops);
+int ota_manifest_load(unzFile zip, struct ota_manifest_s* manifest,
+    struct ota_op_s** ops);
+
+int ota_install_unzread(void* zip, uint8_t* buf, size_t len);
+
+int ota_install(struct ota_install_s* ctx);
+
+#endif /* INSTALL_OTA_INSTALL_H */
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ota_install.h"
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+#include "../bootctl/bootctl.h"
+#endif
+
+#if defined(CONFIG_UTILS_OTA_INSTALL_VERIFY) && CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE > 0
+#include "../verify/avb_verify.h"
+#include "../verify/verify_arena.h"
+#define OTA_MAIN_ARENA
+#endif
+
+static void usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s [-k <key>] [-b] [-j <workers>] [-s] [-B] [-r <KiB/s>] <ota.zip>\n",
+        progname);
+    fprintf(stderr, "    -k <key>  verify every written image with avb and <key>\n");
+    fprintf(stderr, "    -b        install boot slot images to the bootctl update slot\n");
+    fprintf(stderr, "    -j <n>    write up to <n> images at the same time, 1 ~ %d\n",
+        CONFIG_UTILS_OTA_INSTALL_WORKERS);
+    fprintf(stderr, "    -s        the package is an ota.stream, e.g. a FIFO or - for stdin\n");
+    fprintf(stderr, "    -B        install in the background, throttled while the device is busy\n");
+    fprintf(stderr, "    -r <n>    background install at <n> KiB/s\n");
+}
+
+int main(int argc, char* argv[])
+{
+#ifdef OTA_MAIN_ARENA
+    struct verify_arena_s arena;
+    void* base = NULL;
+#endif
+    struct ota_install_s ctx;
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+    size_t rate = 0;
+#endif
+    bool bootctl = false;
+    int ret;
+    int c;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.bufsize = CONFIG_UTILS_OTA_INSTALL_BUFSIZE;
+    ctx.workers = CONFIG_UTILS_OTA_INSTALL_WORKERS;
+
+    while ((c = getopt(argc, argv, "bj:k:sBr:")) != -1) {
+        switch (c) {
+        case 'b':
+            bootctl = true;
+            break;
+        case 'j':
+            ctx.workers = atoi(optarg);
+            if (ctx.workers < 1 || ctx.workers > CONFIG_UTILS_OTA_INSTALL_WORKERS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k':
+            ctx.key = optarg;
+            break;
+        case 's':
+            ctx.stream = true;
+            break;
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+        case 'B':
+            rate = CONFIG_UTILS_OTA_INSTALL_THROTTLE_RATE;
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            if (rate == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+#else
+        case 'B':
+        case 'r':
+            fprintf(stderr, "-%c needs CONFIG_UTILS_OTA_INSTALL_THROTTLE\n", c);
+            return 1;
+#endif
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ctx.package = argv[optind];
+
+#ifndef CONFIG_UTILS_OTA_INSTALL_VERIFY
+    if (ctx.key) {
+        fprintf(stderr, "-k needs CONFIG_UTILS_OTA_INSTALL_VERIFY\n");
+        return 1;
+    }
+#endif
+
+#ifndef CONFIG_UTILS_OTA_INSTALL_STREAM
+    if (ctx.stream) {
+        fprintf(stderr, "-s needs CONFIG_UTILS_OTA_INSTALL_STREAM\n");
+        return 1;
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+    if (bootctl) {
+        ctx.bootctl = bootctl_open();
+        if (ctx.bootctl == NULL) {
+            fprintf(stderr, "bootctl open failed\n");
+            return 1;
+        }
+    }
+#else
+    if (bootctl) {
+        fprintf(stderr, "-b needs CONFIG_UTILS_OTA_INSTALL_BOOTCTL\n");
+        return 1;
+    }
+#endif
+
+    ret = 0;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+
+    /* low priority, charged by the bytes written, full speed when idle */
+
+    if (rate > 0) {
+        ret = ota_throttle_open(&ctx.throttle, rate * 1024);
+        ctx.priority = CONFIG_UTILS_OTA_INSTALL_THROTTLE_PRIORITY;
+    }
+#endif
+
+#ifdef OTA_MAIN_ARENA
+
+    /* the images of -k are verified from one arena taken up front */
+
+    if (ret == 0 && ctx.key) {
+        base = malloc(CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+        if (base == NULL) {
+            fprintf(stderr, "no memory for the %d byte avb arena\n",
+                CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+            ret = -ENOMEM;
+        } else {
+            verify_arena_init(&arena, "CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE", base,
+                CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+            avb_verify_arena(&arena);
+        }
+    }
+#endif
+
+    if (ret == 0) {
+        ret = ota_install(&ctx);
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_BOOTCTL
+    if (ctx.bootctl) {
+        bootctl_close(ctx.bootctl);
+    }
+#endif
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_THROTTLE
+    if (ctx.throttle) {
+        ota_throttle_close(ctx.throttle);
+    }
+#endif
+
+#ifdef OTA_MAIN_ARENA
+    if (base) {
+        OTA_LOG(LOG_INFO, "avb arena peak %zu of %d bytes", arena.peak,
+            CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+        avb_verify_arena(NULL);
+        free(base);
+    }
+#endif
+
+    if (ret < 0) {
+        fprintf(stderr, "install %s failed: %d\n", ctx.package, ret);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "ota_install.h"
+
+static int ota_manifest_fill(const struct ota_src_s* src, void* buf, size_t size)
+{
+    int ret;
+
+    ret = src->read(src->handle, buf, size);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "read " OTA_MANIFEST_NAME " failed, ret: %d", ret);
+        return ret;
+    }
+
+    return (size_t)ret == size ? 0 : -EINVAL;
+}
+
+static bool ota_manifest_check(const struct ota_op_s* op)
+{
+    if (memchr(op->entry, '\0', sizeof(op->entry)) == NULL
+        || memchr(op->target, '\0', sizeof(op->target)) == NULL) {
+        return false;
+    }
+
+    switch (op->type) {
+    case OTA_OP_WRITE:
+        return op->entry[0] != '\0' && op->target[0] != '\0' && op->flags <= OTA_CODEC_ZSTD;
+    case OTA_OP_DELTA:
+    case OTA_OP_VERIFY:
+        return op->entry[0] != '\0' && op->target[0] != '\0';
+    case OTA_OP_HOOK:
+        return op->entry[0] != '\0' && op->flags <= OTA_HOOK_END;
+    default:
+        return false;
+    }
+}
+
+/* the manifest at src, its header and operations are checked */
+
+int ota_manifest_read(const struct ota_src_s* src, struct ota_manifest_s* manifest,
+    struct ota_op_s** ops)
+{
+    size_t size;
+    int ret;
+    int i;
+
+    *ops = NULL;
+    ret = ota_manifest_fill(src, manifest, sizeof(*manifest));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (manifest->magic != OTA_MANIFEST_MAGIC || manifest->version != OTA_MANIFEST_VERSION
+        || manifest->crc != crc32(0, (const Bytef*)manifest, offsetof(struct ota_manifest_s, crc))) {
+        return -EINVAL;
+    }
+
+    size = manifest->nops * sizeof(struct ota_op_s);
+    *ops = malloc(size > 0 ? size : 1);
+    if (*ops == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = ota_manifest_fill(src, *ops, size);
+    if (ret >= 0 && manifest->opscrc != crc32(0, (const Bytef*)*ops, size)) {
+        ret = -EINVAL;
+    }
+
+    for (i = 0; ret >= 0 && i < manifest->nops; i++) {
+        if (!ota_manifest_check(&(*ops)[i])) {
+            ret = -EINVAL;
+        }
+    }
+
+    if (ret < 0) {
+        free(*ops);
+        *ops = NULL;
+    }
+
+    return ret;
+}
+
+/* read ota.manifest of the package, -ENOENT: a package without one */
+
+int ota_manifest_load(unzFile zip, struct ota_manifest_s* manifest,
+    struct ota_op_s** ops)
+{
+    struct ota_src_s src = { ota_install_unzread, zip };
+    int ret;
+
+    *ops = NULL;
+    if (unzLocateFile(zip, OTA_MANIFEST_NAME, 0) != UNZ_OK) {
+        return -ENOENT;
+    }
+
+    if (unzOpenCurrentFile(zip) != UNZ_OK) {
+        return -EINVAL;
+    }
+
+    ret = ota_manifest_read(&src, manifest, ops);
+    if (unzCloseCurrentFile(zip) != UNZ_OK && ret == 0) {
+        ret = -EILSEQ;
+    }
+
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "bad " OTA_MANIFEST_NAME ", ret: %d", ret);
+        free(*ops);
+        *ops = NULL;
+    }
+
+    return ret;
+}
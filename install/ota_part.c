@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <nuttx/mtd/mtd.h>
+
+#include "ota_install.h"
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_SKIP_UNCHANGED
+
+/* read back fill bytes at the partition offset into part->cmp */
+
+static int ota_part_read(struct ota_part_s* part)
+{
+    size_t done = 0;
+    size_t len;
+    ssize_t ret;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    if (part->pipe) {
+        return ota_pipe_read(part->pipe, part->cmp, part->fill, part->offset);
+    }
+#endif
+
+    while (done < part->fill) {
+        len = part->fill - done;
+        if (part->readsize > 0 && len > part->readsize) {
+            len = part->readsize;
+        }
+
+        ret = pread(part->fd, part->cmp + done, len, part->offset + done);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return -EIO;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* true if the partition already holds data, then the block is neither
+ * erased nor programmed. A failed read just writes the block.
+ */
+
+static bool ota_part_unchanged(struct ota_part_s* part, const uint8_t* data)
+{
+    if (ota_part_read(part) < 0 || memcmp(part->cmp, data, part->fill) != 0) {
+        return false;
+    }
+
+    return part->fd < 0 || lseek(part->fd, part->offset + part->fill, SEEK_SET) >= 0;
+}
+#else
+static inline bool ota_part_unchanged(struct ota_part_s* part, const uint8_t* data)
+{
+    return false;
+}
+#endif
+
+/* write fill bytes of data at the partition offset, whole erase blocks
+ * except at the end of the image, so the mtd layer erases and programs
+ * without reading back. data is part->buf, or the caller's data for a
+ * whole block passed through without a copy.
+ */
+
+static int ota_part_flush(struct ota_part_s* part, const uint8_t* data)
+{
+    size_t written = 0;
+    ssize_t ret;
+
+    if (part->fill == 0) {
+        return 0;
+    }
+
+    part->blocks++;
+    if (ota_part_unchanged(part, data)) {
+        part->skipped++;
+        written = part->fill;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    if (part->pipe && written < part->fill) {
+        if (data != part->buf) {
+            memcpy(part->buf, data, part->fill);
+        }
+
+        ret = ota_pipe_push(part->pipe, &part->buf, part->fill, part->offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        written = part->fill;
+    }
+#endif
+
+    while (written < part->fill) {
+        ret = write(part->fd, data + written, part->fill - written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ret = -errno;
+            OTA_LOG(LOG_ERR, "write %s at %jd failed, ret: %zd", part->path,
+                (intmax_t)(part->offset + written), ret);
+            return ret;
+        }
+
+        written += ret;
+    }
+
+    part->offset += part->fill;
+    part->fill = 0;
+    return 0;
+}
+
+static int ota_part_open_fd(struct ota_part_s* part, const char* path, off_t offset)
+{
+    struct mtd_geometry_s geo;
+    int ret;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_SKIP_UNCHANGED
+    part->fd = open(path, O_RDWR | O_CLOEXEC);
+#else
+    part->fd = open(path, O_WRONLY | O_CLOEXEC);
+#endif
+    if (part->fd < 0) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", path, ret);
+        return ret;
+    }
+
+    /* not an mtd partition, e.g. a file, fall back to the buffer size */
+
+    ret = ioctl(part->fd, MTDIOC_GEOMETRY, (unsigned long)&geo);
+    part->blocksize = ret >= 0 && geo.erasesize > 0
+        ? geo.erasesize
+        : CONFIG_UTILS_OTA_INSTALL_BUFSIZE;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_TUNE
+
+    /* measured by ota_tune_calibrate() before the workers started */
+
+    if (ret >= 0 && geo.erasesize > 0) {
+        ota_tune(path, &geo, &part->blocksize, &part->readsize);
+    }
+#endif
+
+    /* resume an interrupted write, offset is always at a flushed block */
+
+    if (offset > 0 && lseek(part->fd, offset, SEEK_SET) != offset) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "seek %s to %jd failed, ret: %d", path, (intmax_t)offset, ret);
+        close(part->fd);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int ota_part_close_fd(struct ota_part_s* part)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    if (part->pipe) {
+        return ota_pipe_close(part->pipe);
+    }
+#endif
+
+    return close(part->fd) < 0 ? -errno : 0;
+}
+
+int ota_part_open(struct ota_part_s* part, const char* path, off_t offset)
+{
+    int ret;
+
+    memset(part, 0, sizeof(*part));
+    strlcpy(part->path, path, sizeof(part->path));
+    part->fd = -1;
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    ret = ota_pipe_depth(path);
+    if (ret > 0) {
+        ret = ota_pipe_open(&part->pipe, path, ret, &part->blocksize);
+    } else {
+        ret = ota_part_open_fd(part, path, offset);
+    }
+#else
+    ret = ota_part_open_fd(part, path, offset);
+#endif
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    part->buf = malloc(part->blocksize);
+    if (part->buf == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_SKIP_UNCHANGED
+    part->cmp = malloc(part->blocksize);
+    if (part->cmp == NULL) {
+        free(part->buf);
+        ret = -ENOMEM;
+        goto err;
+    }
+#endif
+
+    part->offset = offset;
+    return 0;
+
+err:
+    ota_part_close_fd(part);
+    return ret;
+}
+
+int ota_part_write(struct ota_part_s* part, const uint8_t* data, size_t size)
+{
+    size_t len;
+    int ret;
+
+    while (size > 0) {
+
+        /* whole blocks of the caller, e.g. mapped from the package */
+
+        if (part->fill == 0 && size >= part->blocksize) {
+            part->fill = part->blocksize;
+            ret = ota_part_flush(part, data);
+            if (ret < 0) {
+                return ret;
+            }
+
+            data += part->blocksize;
+            size -= part->blocksize;
+            continue;
+        }
+
+        len = part->blocksize - part->fill;
+        if (len > size) {
+            len = size;
+        }
+
+        memcpy(part->buf + part->fill, data, len);
+        part->fill += len;
+        data += len;
+        size -= len;
+
+        if (part->fill == part->blocksize) {
+            ret = ota_part_flush(part, part->buf);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* make everything before part->offset durable, drivers without a cache
+ * do not implement fsync
+ */
+
+int ota_part_sync(struct ota_part_s* part)
+{
+#ifdef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD
+    if (part->pipe) {
+        return ota_pipe_drain(part->pipe);
+    }
+#endif
+
+    if (fsync(part->fd) < 0 && errno != EINVAL && errno != ENOSYS && errno != ENOTTY) {
+        OTA_LOG(LOG_ERR, "sync %s failed, ret: %d", part->path, -errno);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* abort drops the partial block, a failed or corrupt entry must not
+ * program it, the whole blocks before it are kept for the checkpoint
+ */
+
+int ota_part_close(struct ota_part_s* part, bool abort)
+{
+    int ret = 0;
+    int err;
+
+    if (!abort) {
+        ret = ota_part_flush(part, part->buf);
+    }
+
+    err = ota_part_close_fd(part);
+    if (ret == 0) {
+        ret = err;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_SKIP_UNCHANGED
+    free(part->cmp);
+    part->cmp = NULL;
+#endif
+    free(part->buf);
+    part->buf = NULL;
+    return ret;
+}
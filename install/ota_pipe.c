@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Erase-ahead pipeline for an MTD partition.
+ *
+ * The installer pushes whole erase blocks into a ring of depth slots, an
+ * eraser task erases the blocks pushed while a programmer task programs
+ * the blocks already erased:
+ *
+ *      head            erase           tail
+ *   ... | programming   | erased        | filled, to erase | free ...
+ *
+ * so the installer inflates block N + depth while the flash erases and
+ * programs the blocks before it. Most NOR drivers can not take a program
+ * while an erase is running, the two tasks take turns on the driver unless
+ * CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD_CONCURRENT says it can, then block
+ * N + 1 is erased while block N is programmed.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nuttx/fs/fs.h>
+#include <nuttx/mtd/mtd.h>
+
+#include "ota_install.h"
+
+struct ota_pipe_slot_s {
+    uint8_t* buf; /* one erase block */
+    off_t offset; /* partition offset, erase block aligned */
+    size_t len;
+};
+
+struct ota_pipe_s {
+    struct inode* inode;
+    struct mtd_dev_s* mtd;
+    struct mtd_geometry_s geo;
+    pthread_mutex_t lock;
+    pthread_mutex_t mtdlock; /* one mtd call at a time */
+    pthread_cond_t cond;
+    pthread_t eraser;
+    pthread_t programmer;
+    unsigned int head; /* next slot to program */
+    unsigned int erase; /* next slot to erase */
+    unsigned int tail; /* next slot to fill */
+    bool eof;
+    int error;
+    int depth;
+    struct ota_pipe_slot_s slot[];
+};
+
+/* ring depth for the partition in CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD_DEVICES,
+ * "<part>:<blocks>" separated by ',', e.g. "ap:4,audio:2". 0: not listed,
+ * the partition is written with write().
+ */
+
+int ota_pipe_depth(const char* path)
+{
+    const char* devices = CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD_DEVICES;
+    const char* name = path;
+    size_t len;
+
+    if (strncmp(name, "/dev/", 5) == 0) {
+        name += 5;
+    }
+
+    len = strlen(name);
+    while (*devices != '\0') {
+        size_t n = strcspn(devices, ":,");
+
+        if (n == len && strncmp(devices, name, len) == 0) {
+            return devices[n] == ':' ? atoi(devices + n + 1) : 2;
+        }
+
+        devices += strcspn(devices, ",");
+        if (*devices != '\0') {
+            devices++;
+        }
+    }
+
+    return 0;
+}
+
+static void ota_pipe_mtd_lock(struct ota_pipe_s* pipe)
+{
+#ifndef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD_CONCURRENT
+    pthread_mutex_lock(&pipe->mtdlock);
+#endif
+}
+
+static void ota_pipe_mtd_unlock(struct ota_pipe_s* pipe)
+{
+#ifndef CONFIG_UTILS_OTA_INSTALL_ERASE_AHEAD_CONCURRENT
+    pthread_mutex_unlock(&pipe->mtdlock);
+#endif
+}
+
+static void ota_pipe_fail(struct ota_pipe_s* pipe, int ret)
+{
+    if (pipe->error == 0) {
+        pipe->error = ret;
+    }
+
+    pthread_cond_broadcast(&pipe->cond);
+}
+
+static void* ota_pipe_eraser(void* arg)
+{
+    struct ota_pipe_s* pipe = arg;
+    struct ota_pipe_slot_s* slot;
+    int ret;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (; ; ) {
+        while (pipe->erase == pipe->tail && pipe->error == 0 && !pipe->eof) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+
+        if (pipe->error < 0 || pipe->erase == pipe->tail) {
+            break;
+        }
+
+        slot = &pipe->slot[pipe->erase % pipe->depth];
+        pthread_mutex_unlock(&pipe->lock);
+
+        ota_pipe_mtd_lock(pipe);
+        ret = MTD_ERASE(pipe->mtd, slot->offset / pipe->geo.erasesize, 1);
+        ota_pipe_mtd_unlock(pipe);
+
+        pthread_mutex_lock(&pipe->lock);
+        if (ret < 0) {
+            OTA_LOG(LOG_ERR, "erase at %jd failed, ret: %d", (intmax_t)slot->offset, ret);
+            ota_pipe_fail(pipe, ret);
+            break;
+        }
+
+        pipe->erase++;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+static void* ota_pipe_programmer(void* arg)
+{
+    struct ota_pipe_s* pipe = arg;
+    struct ota_pipe_slot_s* slot;
+    size_t nblocks;
+    ssize_t ret;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (; ; ) {
+        while (pipe->head == pipe->erase && pipe->error == 0
+            && !(pipe->eof && pipe->head == pipe->tail)) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+
+        if (pipe->error < 0 || pipe->head == pipe->erase) {
+            break;
+        }
+
+        slot = &pipe->slot[pipe->head % pipe->depth];
+        pthread_mutex_unlock(&pipe->lock);
+
+        /* the end of the image, pad the last program block as erased */
+
+        nblocks = (slot->len + pipe->geo.blocksize - 1) / pipe->geo.blocksize;
+        memset(slot->buf + slot->len, 0xff, nblocks * pipe->geo.blocksize - slot->len);
+        ota_pipe_mtd_lock(pipe);
+        ret = MTD_BWRITE(pipe->mtd, slot->offset / pipe->geo.blocksize, nblocks, slot->buf);
+        ota_pipe_mtd_unlock(pipe);
+
+        pthread_mutex_lock(&pipe->lock);
+        if (ret != (ssize_t)nblocks) {
+            ret = ret < 0 ? ret : -EIO;
+            OTA_LOG(LOG_ERR, "program at %jd failed, ret: %zd", (intmax_t)slot->offset, ret);
+            ota_pipe_fail(pipe, ret);
+            break;
+        }
+
+        pipe->head++;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+int ota_pipe_open(struct ota_pipe_s** ppipe, const char* path, int depth,
+    size_t* erasesize)
+{
+    struct ota_pipe_s* pipe;
+    pthread_attr_t attr;
+    int ret;
+    int i;
+
+    if (depth < 2) {
+        return -EINVAL;
+    }
+
+    pipe = calloc(1, sizeof(*pipe) + depth * sizeof(pipe->slot[0]));
+    if (pipe == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = find_mtddriver(path, &pipe->inode);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "%s is not an mtd partition, ret: %d", path, ret);
+        free(pipe);
+        return ret;
+    }
+
+    pipe->mtd = pipe->inode->u.i_mtd;
+    pipe->depth = depth;
+    ret = MTD_IOCTL(pipe->mtd, MTDIOC_GEOMETRY, (unsigned long)&pipe->geo);
+    if (ret < 0 || pipe->geo.erasesize == 0
+        || pipe->geo.erasesize % pipe->geo.blocksize != 0) {
+        ret = ret < 0 ? ret : -EINVAL;
+        goto err;
+    }
+
+    for (i = 0; i < depth; i++) {
+        pipe->slot[i].buf = malloc(pipe->geo.erasesize);
+        if (pipe->slot[i].buf == NULL) {
+            ret = -ENOMEM;
+            goto err;
+        }
+    }
+
+    /* run at the priority of the worker, lowered for a background install */
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_mutex_init(&pipe->mtdlock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    ret = -pthread_create(&pipe->eraser, &attr, ota_pipe_eraser, pipe);
+    if (ret < 0) {
+        pthread_attr_destroy(&attr);
+        goto err_sync;
+    }
+
+    ret = -pthread_create(&pipe->programmer, &attr, ota_pipe_programmer, pipe);
+    pthread_attr_destroy(&attr);
+    if (ret < 0) {
+        pthread_mutex_lock(&pipe->lock);
+        pipe->eof = true;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        pthread_join(pipe->eraser, NULL);
+        goto err_sync;
+    }
+
+    *erasesize = pipe->geo.erasesize;
+    *ppipe = pipe;
+    return 0;
+
+err_sync:
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->mtdlock);
+    pthread_mutex_destroy(&pipe->lock);
+err:
+    for (i = 0; i < depth; i++) {
+        free(pipe->slot[i].buf);
+    }
+
+    close_mtddriver(pipe->inode);
+    free(pipe);
+    return ret;
+}
+
+/* read back len bytes at offset, len rounded up to whole program blocks */
+
+int ota_pipe_read(struct ota_pipe_s* pipe, uint8_t* buf, size_t len, off_t offset)
+{
+    size_t nblocks = (len + pipe->geo.blocksize - 1) / pipe->geo.blocksize;
+    ssize_t ret;
+
+    ota_pipe_mtd_lock(pipe);
+    ret = MTD_BREAD(pipe->mtd, offset / pipe->geo.blocksize, nblocks, buf);
+    ota_pipe_mtd_unlock(pipe);
+    return ret == (ssize_t)nblocks ? 0 : (ret < 0 ? ret : -EIO);
+}
+
+/* queue the erase block in *buf, *buf gets a free one in exchange */
+
+int ota_pipe_push(struct ota_pipe_s* pipe, uint8_t** buf, size_t len, off_t offset)
+{
+    struct ota_pipe_slot_s* slot;
+    uint8_t* tmp;
+    int ret;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->tail - pipe->head == pipe->depth && pipe->error == 0) {
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+
+    ret = pipe->error;
+    if (ret == 0) {
+        slot = &pipe->slot[pipe->tail % pipe->depth];
+        tmp = slot->buf;
+        slot->buf = *buf;
+        slot->len = len;
+        slot->offset = offset;
+        *buf = tmp;
+        pipe->tail++;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    return ret;
+}
+
+/* wait until every block pushed is programmed */
+
+int ota_pipe_drain(struct ota_pipe_s* pipe)
+{
+    int ret;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->head != pipe->tail && pipe->error == 0) {
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    }
+
+    ret = pipe->error;
+    pthread_mutex_unlock(&pipe->lock);
+    return ret;
+}
+
+int ota_pipe_close(struct ota_pipe_s* pipe)
+{
+    int ret;
+    int i;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->eof = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    pthread_join(pipe->eraser, NULL);
+    pthread_join(pipe->programmer, NULL);
+
+    ret = pipe->error;
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->mtdlock);
+    pthread_mutex_destroy(&pipe->lock);
+    for (i = 0; i < pipe->depth; i++) {
+        free(pipe->slot[i].buf);
+    }
+
+    close_mtddriver(pipe->inode);
+    free(pipe);
+    return ret;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Stored entries, e.g. from gen_ota_zip.py --store, are read straight out
+ * of the package instead of through minizip. With
+ * CONFIG_UTILS_OTA_INSTALL_MMAP and a package on a file system that maps
+ * in place (XIP), the entry is handed to the partition writer where it
+ * lies, the image goes from the package to the partition without a copy.
+ * Otherwise it is read with pread() into the caller's buffer: mmap() of a
+ * file that is not XIP copies all of it into RAM first.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "ota_install.h"
+
+int ota_stored_open(struct ota_stored_s* stored, const char* package, off_t offset,
+    uint64_t size, uint32_t crc)
+{
+    int ret;
+
+    memset(stored, 0, sizeof(*stored));
+    stored->offset = offset;
+    stored->size = size;
+    stored->want = crc;
+    stored->fd = open(package, O_RDONLY | O_CLOEXEC);
+    if (stored->fd < 0) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", package, ret);
+        return ret;
+    }
+
+#ifdef CONFIG_UTILS_OTA_INSTALL_MMAP
+    {
+        void* base = NULL;
+
+        /* only a file system that maps in place knows the address */
+
+        if (ioctl(stored->fd, FIOC_MMAP, (unsigned long)&base) >= 0 && base != NULL) {
+            stored->map = (const uint8_t*)base + offset;
+        } else {
+            OTA_LOG(LOG_INFO, "%s is not mapped in place, read it", package);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* up to len bytes of the entry at *data, which is in buf or the mapping.
+ * 0: the whole entry was read and its crc matched.
+ */
+
+ssize_t ota_stored_read(struct ota_stored_s* stored, uint8_t* buf, size_t len,
+    const uint8_t** data)
+{
+    ssize_t ret;
+
+    if (len > stored->size - stored->pos) {
+        len = stored->size - stored->pos;
+    }
+
+    if (len == 0) {
+        if (stored->crc != stored->want) {
+            OTA_LOG(LOG_ERR, "stored entry crc %08" PRIx32 ", expected %08" PRIx32,
+                stored->crc, stored->want);
+            return -EILSEQ;
+        }
+
+        return 0;
+    }
+
+    if (stored->map != NULL) {
+        *data = stored->map + stored->pos;
+    } else {
+        ret = pread(stored->fd, buf, len, stored->offset + stored->pos);
+        if (ret <= 0) {
+            ret = ret < 0 ? -errno : -EINVAL;
+            OTA_LOG(LOG_ERR, "read stored entry failed, ret: %zd", ret);
+            return ret;
+        }
+
+        len = ret;
+        *data = buf;
+    }
+
+    stored->crc = crc32(stored->crc, *data, len);
+    stored->pos += len;
+    return len;
+}
+
+void ota_stored_close(struct ota_stored_s* stored)
+{
+    close(stored->fd);
+}
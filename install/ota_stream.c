@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Read an ota.stream of gen_ota_zip.py --stream from a pipe, a FIFO or
+ * stdin, without seeking and without staging it anywhere. The header,
+ * ota.manifest and the entry table are read and checked against the
+ * signature first, then the entries are handed out one after the other
+ * as the installer asks for them. An entry that is not asked for is read
+ * past, the stream never goes back.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <avb_rsa.h>
+#include <avb_sha.h>
+#include <avb_util.h>
+
+#include "ota_install.h"
+
+struct ota_stream_s {
+    int fd;
+    AvbSHA256Ctx sha; /* of the signed header, then of the current entry */
+    struct ota_stream_entry_s* entries;
+    int nentries;
+    int current; /* entry being read, -1: none yet */
+    uint64_t left; /* bytes of the current entry not read from fd */
+    bool checked; /* the digest of the current entry matched */
+    bool end; /* the current entry was inflated to its end */
+    uLong crc; /* of the current entry so far */
+    uint64_t size;
+    z_stream zs;
+    uint8_t* in; /* deflated input of the current entry */
+    size_t insize;
+};
+
+/* exactly len bytes from the stream, a short stream is corrupted */
+
+static int ota_stream_raw(struct ota_stream_s* stream, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = read(stream->fd, p, len);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            ret = ret < 0 ? -errno : -EPIPE;
+            OTA_LOG(LOG_ERR, "read stream failed, ret: %zd", ret);
+            return ret;
+        }
+
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/* the signed part of the stream, hashed as it is read */
+
+static int ota_stream_signed(void* handle, uint8_t* buf, size_t len)
+{
+    struct ota_stream_s* stream = handle;
+    int ret;
+
+    ret = ota_stream_raw(stream, buf, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    avb_sha256_update(&stream->sha, buf, len);
+    return len;
+}
+
+/* the stream is signed with RSA2048, key must be an avb public key of it */
+
+static int ota_stream_verify(const uint8_t* digest, const uint8_t* sig, size_t siglen,
+    const char* key)
+{
+    const AvbAlgorithmData* algorithm;
+    AvbRSAPublicKeyHeader header;
+    uint8_t* pubkey;
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    fd = open(key, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", key, -errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return -ENOENT;
+    }
+
+    if (st.st_size != sizeof(header) + 2 * (2048 / 8)) {
+        OTA_LOG(LOG_ERR, "%s is not an RSA2048 key, %jd bytes", key, (intmax_t)st.st_size);
+        close(fd);
+        return -EINVAL;
+    }
+
+    pubkey = malloc(st.st_size);
+    if (pubkey == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    len = read(fd, pubkey, st.st_size);
+    close(fd);
+
+    memcpy(&header, pubkey, sizeof(header));
+    if (len == st.st_size && avb_be32toh(header.key_num_bits) != 2048) {
+        OTA_LOG(LOG_ERR, "%s is not an RSA2048 key, %" PRIu32 " bits", key,
+            avb_be32toh(header.key_num_bits));
+        free(pubkey);
+        return -EINVAL;
+    }
+
+    algorithm = avb_get_algorithm_data(AVB_ALGORITHM_TYPE_SHA256_RSA2048);
+    if (len != st.st_size || algorithm == NULL
+        || !avb_rsa_verify(pubkey, len, sig, siglen, digest, AVB_SHA256_DIGEST_SIZE,
+            algorithm->padding, algorithm->padding_len)) {
+        free(pubkey);
+        OTA_LOG(LOG_ERR, "bad stream signature");
+        return -EPERM;
+    }
+
+    free(pubkey);
+    return 0;
+}
+
+/* the header of the stream up to the first entry, signed with key */
+
+static int ota_stream_header(struct ota_stream_s* stream, const char* key,
+    struct ota_manifest_s* manifest, struct ota_op_s** ops)
+{
+    struct ota_src_s src = { ota_stream_signed, stream };
+    struct ota_stream_header_s header;
+    uint8_t digest[AVB_SHA256_DIGEST_SIZE];
+    uint8_t sig[OTA_STREAM_SIG_MAX];
+    int ret;
+    int i;
+
+    avb_sha256_init(&stream->sha);
+    ret = ota_stream_signed(stream, (uint8_t*)&header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (header.magic != OTA_STREAM_MAGIC || header.version != OTA_STREAM_VERSION
+        || header.siglen == 0 || header.siglen > sizeof(sig)) {
+        OTA_LOG(LOG_ERR, "not an ota stream");
+        return -EINVAL;
+    }
+
+    ret = ota_manifest_read(&src, manifest, ops);
+    if (ret < 0) {
+        OTA_LOG(LOG_ERR, "bad " OTA_MANIFEST_NAME ", ret: %d", ret);
+        return ret;
+    }
+
+    /* the table is allocated before it is signature checked, every entry
+     * is used by an operation and the table has to fit in the buffer
+     */
+
+    if (header.nentries > manifest->nops
+        || header.nentries * sizeof(*stream->entries) > stream->insize) {
+        OTA_LOG(LOG_ERR, "too many stream entries: %u", header.nentries);
+        return -E2BIG;
+    }
+
+    stream->nentries = header.nentries;
+    stream->entries = malloc(header.nentries * sizeof(*stream->entries) + 1);
+    if (stream->entries == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = ota_stream_signed(stream, (uint8_t*)stream->entries,
+        header.nentries * sizeof(*stream->entries));
+    if (ret < 0) {
+        return ret;
+    }
+
+    memcpy(digest, avb_sha256_final(&stream->sha), sizeof(digest));
+    ret = ota_stream_raw(stream, sig, header.siglen);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = ota_stream_verify(digest, sig, header.siglen, key);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < stream->nentries; i++) {
+        if (memchr(stream->entries[i].name, '\0', sizeof(stream->entries[i].name)) == NULL
+            || (stream->entries[i].method != 0 && stream->entries[i].method != Z_DEFLATED)) {
+            OTA_LOG(LOG_ERR, "bad stream entry %d", i);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/* the rest of the current entry was read, its digest must match */
+
+static int ota_stream_check(struct ota_stream_s* stream)
+{
+    const struct ota_stream_entry_s* entry = &stream->entries[stream->current];
+
+    if (!stream->checked) {
+        if (memcmp(avb_sha256_final(&stream->sha), entry->digest, sizeof(entry->digest)) != 0) {
+            OTA_LOG(LOG_ERR, "%s digest mismatch", entry->name);
+            return -EILSEQ;
+        }
+
+        stream->checked = true;
+    }
+
+    return 0;
+}
+
+static int ota_stream_fill(struct ota_stream_s* stream, size_t len)
+{
+    int ret;
+
+    if (len > stream->left) {
+        len = stream->left;
+    }
+
+    ret = ota_stream_raw(stream, stream->in, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    avb_sha256_update(&stream->sha, stream->in, len);
+    stream->left -= len;
+    return len;
+}
+
+/* read past what is left of the current entry */
+
+static int ota_stream_skip(struct ota_stream_s* stream)
+{
+    int ret;
+
+    while (stream->left > 0) {
+        ret = ota_stream_fill(stream, stream->insize);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return ota_stream_check(stream);
+}
+
+int ota_stream_open(struct ota_stream_s** pstream, const char* path, const char* key,
+    size_t bufsize, struct ota_manifest_s* manifest, struct ota_op_s** ops)
+{
+    struct ota_stream_s* stream;
+    int ret;
+
+    *ops = NULL;
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        return -ENOMEM;
+    }
+
+    stream->current = -1;
+    stream->insize = bufsize;
+    stream->in = malloc(bufsize);
+    if (stream->in == NULL || inflateInit2(&stream->zs, -MAX_WBITS) != Z_OK) {
+        free(stream->in);
+        free(stream);
+        return -ENOMEM;
+    }
+
+    stream->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY | O_CLOEXEC);
+    if (stream->fd < 0) {
+        ret = -errno;
+        OTA_LOG(LOG_ERR, "open %s failed, ret: %d", path, ret);
+        stream->fd = -1;
+        goto err;
+    }
+
+    ret = ota_stream_header(stream, key, manifest, ops);
+    if (ret < 0) {
+        goto err;
+    }
+
+    *pstream = stream;
+    return 0;
+
+err:
+    free(*ops);
+    *ops = NULL;
+    ota_stream_close(stream);
+    return ret;
+}
+
+/* the entry as the zip would list it, -ENOENT: not in the stream */
+
+int ota_stream_info(struct ota_stream_s* stream, const char* name, unz_file_info64* info)
+{
+    const struct ota_stream_entry_s* entry;
+    int i;
+
+    for (i = 0; i < stream->nentries; i++) {
+        entry = &stream->entries[i];
+        if (strcmp(entry->name, name) == 0) {
+            memset(info, 0, sizeof(*info));
+            info->compression_method = entry->method;
+            info->crc = entry->crc;
+            info->compressed_size = entry->csize;
+            info->uncompressed_size = entry->size;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* move to the entry name, the entries before it are read past */
+
+int ota_stream_next(struct ota_stream_s* stream, const char* name)
+{
+    const struct ota_stream_entry_s* entry;
+    int ret;
+
+    do {
+        if (stream->current >= 0) {
+            ret = ota_stream_skip(stream);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (stream->current + 1 >= stream->nentries) {
+            OTA_LOG(LOG_ERR, "%s is not ahead in the stream", name);
+            return -ENOENT;
+        }
+
+        entry = &stream->entries[++stream->current];
+        avb_sha256_init(&stream->sha);
+        stream->left = entry->csize;
+        stream->checked = false;
+        stream->end = false;
+        stream->crc = crc32(0, Z_NULL, 0);
+        stream->size = 0;
+        stream->zs.avail_in = 0;
+    } while (strcmp(entry->name, name) != 0);
+
+    return inflateReset(&stream->zs) == Z_OK ? 0 : -EINVAL;
+}
+
+/* up to len bytes of the current entry, 0: the whole entry was read and
+ * matched the table
+ */
+
+int ota_stream_read(void* handle, uint8_t* buf, size_t len)
+{
+    struct ota_stream_s* stream = handle;
+    const struct ota_stream_entry_s* entry = &stream->entries[stream->current];
+    size_t n = 0;
+    int ret;
+
+    if (entry->method == 0) {
+        n = len < stream->left ? len : stream->left;
+        ret = ota_stream_raw(stream, buf, n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        avb_sha256_update(&stream->sha, buf, n);
+        stream->left -= n;
+    } else {
+        stream->zs.next_out = buf;
+        stream->zs.avail_out = len;
+        while (stream->zs.avail_out == len && !stream->end) {
+            if (stream->zs.avail_in == 0) {
+                ret = ota_stream_fill(stream, stream->insize);
+                if (ret <= 0) {
+                    OTA_LOG(LOG_ERR, "%s is truncated", entry->name);
+                    return ret < 0 ? ret : -EINVAL;
+                }
+
+                stream->zs.next_in = stream->in;
+                stream->zs.avail_in = ret;
+            }
+
+            ret = inflate(&stream->zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                OTA_LOG(LOG_ERR, "inflate %s failed, ret: %d", entry->name, ret);
+                return -EINVAL;
+            }
+
+            stream->end = ret == Z_STREAM_END;
+        }
+
+        n = len - stream->zs.avail_out;
+    }
+
+    if (n > 0) {
+        stream->crc = crc32(stream->crc, buf, n);
+        stream->size += n;
+        return n;
+    }
+
+    if (stream->left > 0 || stream->zs.avail_in > 0) {
+        OTA_LOG(LOG_ERR, "data after %s", entry->name);
+        return -EINVAL;
+    }
+
+    ret = ota_stream_check(stream);
+    if (ret >= 0 && (stream->crc != entry->crc || stream->size != entry->size)) {
+        OTA_LOG(LOG_ERR, "%s crc mismatch", entry->name);
+        ret = -EILSEQ;
+    }
+
+    return ret;
+}
+
+void ota_stream_close(struct ota_stream_s* stream)
+{
+    if (stream->fd >= 0) {
+        close(stream->fd);
+    }
+
+    inflateEnd(&stream->zs);
+    free(stream->entries);
+    free(stream->in);
+    free(stream);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Background install, "ota_install -B": the workers share a token bucket
+ * of rate bytes per second, charged with every chunk written or read
+ * back. A worker in debt sleeps it off, otherwise it yields.
+ *
+ * Once a second the load of the rest of the system is taken from
+ * /proc/cpuload minus /proc/<tid>/loadavg of the workers. Up to
+ * CONFIG_UTILS_OTA_INSTALL_THROTTLE_IDLE percent the device counts as
+ * idle and the install runs at full speed. Otherwise the rate is halved
+ * while the workers use more than CONFIG_UTILS_OTA_INSTALL_THROTTLE_CPU
+ * percent of the cpu, down to an eighth, and grows back to the rate
+ * asked for below it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ota_install.h"
+
+#define OTA_THROTTLE_BURST 10 /* 1/10 s of the rate may be spent at once */
+#define OTA_THROTTLE_SAMPLE 1000000 /* us between two load samples */
+#define OTA_THROTTLE_MIN 8 /* the rate goes down to 1/8 for the cpu budget */
+#define OTA_THROTTLE_TIDS (CONFIG_UTILS_OTA_INSTALL_WORKERS + 1)
+
+struct ota_throttle_s {
+    pthread_mutex_t lock;
+    uint64_t target; /* bytes/s asked for */
+    uint64_t rate; /* bytes/s now */
+    int64_t tokens; /* bytes, below 0: owed */
+    uint64_t last; /* us, last refill */
+    uint64_t sampled; /* us, last load sample, 0: never */
+    bool idle;
+    bool noload; /* no /proc/cpuload, the rate is fixed */
+    int ntids;
+    pid_t tids[OTA_THROTTLE_TIDS];
+};
+
+static uint64_t ota_throttle_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the percentage in a procfs load file, e.g. "  12.5%", <0: unreadable */
+
+static int ota_throttle_percent(const char* path)
+{
+    char buf[32];
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -EIO;
+    }
+
+    buf[len] = '\0';
+    return (int)(strtod(buf, NULL) + 0.5);
+}
+
+/* called with the lock held, once per OTA_THROTTLE_SAMPLE */
+
+static void ota_throttle_sample(struct ota_throttle_s* throttle, uint64_t now)
+{
+    char path[32];
+    bool idle;
+    int total;
+    int own = 0;
+    int ret;
+    int i;
+
+    throttle->sampled = now;
+    total = ota_throttle_percent("/proc/cpuload");
+    if (total < 0) {
+        OTA_LOG(LOG_WARNING, "no /proc/cpuload, throttle at a fixed rate");
+        throttle->noload = true;
+        return;
+    }
+
+    for (i = 0; i < throttle->ntids; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/loadavg", throttle->tids[i]);
+        ret = ota_throttle_percent(path);
+        if (ret > 0) {
+            own += ret;
+        }
+    }
+
+    idle = total - own <= CONFIG_UTILS_OTA_INSTALL_THROTTLE_IDLE;
+    if (!idle && own > CONFIG_UTILS_OTA_INSTALL_THROTTLE_CPU) {
+        throttle->rate /= 2;
+        if (throttle->rate < throttle->target / OTA_THROTTLE_MIN) {
+            throttle->rate = throttle->target / OTA_THROTTLE_MIN;
+        }
+    } else if (!idle && throttle->rate < throttle->target) {
+        throttle->rate += throttle->target / OTA_THROTTLE_MIN;
+        if (throttle->rate > throttle->target) {
+            throttle->rate = throttle->target;
+        }
+    }
+
+    if (throttle->rate == 0) {
+        throttle->rate = 1;
+    }
+
+    if (idle != throttle->idle) {
+        OTA_LOG(LOG_INFO, "throttle: load %d%%, own %d%%, %s", total, own,
+            idle ? "idle, full speed" : "busy");
+    }
+
+    throttle->idle = idle;
+}
+
+int ota_throttle_open(struct ota_throttle_s** pthrottle, size_t rate)
+{
+    struct ota_throttle_s* throttle;
+
+    if (rate == 0) {
+        return -EINVAL;
+    }
+
+    throttle = calloc(1, sizeof(*throttle));
+    if (throttle == NULL) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&throttle->lock, NULL);
+    throttle->target = rate;
+    throttle->rate = rate;
+    throttle->last = ota_throttle_now();
+    *pthrottle = throttle;
+    return 0;
+}
+
+/* count the load of the calling worker as the install's own */
+
+void ota_throttle_join(struct ota_throttle_s* throttle)
+{
+    pthread_mutex_lock(&throttle->lock);
+    if (throttle->ntids < OTA_THROTTLE_TIDS) {
+        throttle->tids[throttle->ntids++] = gettid();
+    }
+
+    pthread_mutex_unlock(&throttle->lock);
+}
+
+/* charge bytes of flash i/o, then sleep until they are paid for */
+
+void ota_throttle(struct ota_throttle_s* throttle, size_t bytes)
+{
+    uint64_t now = ota_throttle_now();
+    uint64_t wait = 0;
+    int64_t burst;
+
+    pthread_mutex_lock(&throttle->lock);
+    if (!throttle->noload && now - throttle->sampled >= OTA_THROTTLE_SAMPLE) {
+        ota_throttle_sample(throttle, now);
+    }
+
+    burst = throttle->rate / OTA_THROTTLE_BURST;
+    if (throttle->idle) {
+        throttle->tokens = burst;
+    } else {
+        throttle->tokens += (now - throttle->last) * throttle->rate / 1000000;
+        if (throttle->tokens > burst) {
+            throttle->tokens = burst;
+        }
+
+        throttle->tokens -= bytes;
+        if (throttle->tokens < 0) {
+            wait = -throttle->tokens * 1000000 / throttle->rate;
+        }
+    }
+
+    throttle->last = now;
+    pthread_mutex_unlock(&throttle->lock);
+
+    if (wait > 0) {
+        struct timespec ts = { wait / 1000000, wait % 1000000 * 1000 };
+
+        nanosleep(&ts, NULL);
+    } else {
+        sched_yield();
+    }
+}
+
+void ota_throttle_close(struct ota_throttle_s* throttle)
+{
+    pthread_mutex_destroy(&throttle->lock);
+    free(throttle);
+}
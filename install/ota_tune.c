@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The write and read sizes of an mtd partition, measured the first time
+ * it is written and kept in persist.ota.tune.<xxx>. Every power of two
+ * from the erase block (write) or the page (read) up to
+ * CONFIG_UTILS_OTA_INSTALL_TUNE_MAX is timed over
+ * CONFIG_UTILS_OTA_INSTALL_TUNE_BYTES, the fastest size wins. Reads all
+ * start at the beginning of the partition, each write size rewrites its
+ * own slice after the previous one unchanged, so no block is erased more
+ * than once for it. It runs before any worker starts, on a partition the
+ * image overwrites right after anyway, the numbers kept for good do not
+ * include the writes of other partitions.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kvdb.h>
+#include <nuttx/mtd/mtd.h>
+
+#include "ota_install.h"
+
+#define OTA_TUNE_PREFIX "persist.ota.tune."
+#define OTA_TUNE_READ_MIN 512 /* smaller reads are never worth a call each */
+
+/* persist.ota.tune.<xxx>, dropped when the geometry changed */
+
+struct ota_tune_s {
+    uint32_t erasesize;
+    uint32_t pagesize;
+    uint32_t writesize;
+    uint32_t readsize;
+};
+
+static uint64_t ota_tune_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* KiB/s of bytes in us */
+
+static uint64_t ota_tune_rate(uint64_t bytes, uint64_t us)
+{
+    return bytes * 1000000 / 1024 / (us > 0 ? us : 1);
+}
+
+static int ota_tune_io(int fd, uint8_t* buf, size_t len, off_t offset, bool write)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = write ? pwrite(fd, buf + done, len - done, offset + done)
+                    : pread(fd, buf + done, len - done, offset + done);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            return ret < 0 ? -errno : -EIO;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/* us to read, or read and write back, len bytes at offset in size chunks */
+
+static int64_t ota_tune_pass(int fd, uint8_t* buf, size_t size, off_t offset, size_t len,
+    bool write)
+{
+    uint64_t us = 0;
+    uint64_t start;
+    size_t pos;
+    int ret;
+
+    for (pos = 0; pos < len; pos += size) {
+        start = ota_tune_now();
+        ret = ota_tune_io(fd, buf, size, offset + pos, false);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (!write) {
+            us += ota_tune_now() - start;
+            continue;
+        }
+
+        start = ota_tune_now();
+        ret = ota_tune_io(fd, buf, size, offset + pos, true);
+        if (ret < 0) {
+            return ret;
+        }
+
+        us += ota_tune_now() - start;
+    }
+
+    /* drivers with a write cache program it here */
+
+    if (write) {
+        start = ota_tune_now();
+        if (fsync(fd) < 0 && errno != EINVAL && errno != ENOSYS && errno != ENOTTY) {
+            return -errno;
+        }
+
+        us += ota_tune_now() - start;
+    }
+
+    return us;
+}
+
+/* the fastest power of two of unit up to max, 0: none could be measured.
+ * Each size is timed over region bytes, the writes in slices one after the
+ * other up to the end of the partition.
+ */
+
+static size_t ota_tune_pick(const char* path, int fd, uint8_t* buf, size_t unit,
+    size_t max, size_t region, uint64_t partsize, bool write)
+{
+    uint64_t offset = 0;
+    uint64_t best = 0;
+    uint64_t rate;
+    size_t pick = 0;
+    size_t size;
+    size_t len;
+    int64_t us;
+
+    for (size = unit; size <= max && size <= region; size *= 2) {
+        len = region - region % size;
+        if (offset + len > partsize) {
+            break;
+        }
+
+        us = ota_tune_pass(fd, buf, size, offset, len, write);
+        if (us < 0) {
+            OTA_LOG(LOG_WARNING, "tune %s %s %zu failed, ret: %" PRId64, path,
+                write ? "write" : "read", size, us);
+            break;
+        }
+
+        rate = ota_tune_rate(len, us);
+        OTA_LOG(LOG_INFO, "tune %s: %s %zu: %" PRIu64 " KiB/s", path,
+            write ? "write" : "read", size, rate);
+        if (rate > best) {
+            best = rate;
+            pick = size;
+        }
+
+        if (write) {
+            offset += len;
+        }
+    }
+
+    return pick;
+}
+
+static int ota_tune_measure(const char* path, const struct mtd_geometry_s* geo,
+    struct ota_tune_s* tune)
+{
+    uint64_t partsize = (uint64_t)geo->erasesize * geo->neraseblocks;
+    size_t region = CONFIG_UTILS_OTA_INSTALL_TUNE_BYTES;
+    size_t max = CONFIG_UTILS_OTA_INSTALL_TUNE_MAX;
+    size_t page = geo->blocksize;
+    uint8_t* buf;
+    int fd;
+
+    while (page < OTA_TUNE_READ_MIN) {
+        page *= 2;
+    }
+
+    if (region > partsize) {
+        region = partsize;
+    }
+
+    if (max < geo->erasesize || region < geo->erasesize) {
+        return -EINVAL;
+    }
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    buf = malloc(max);
+    if (buf == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    tune->readsize = ota_tune_pick(path, fd, buf, page,
+        max < CONFIG_UTILS_OTA_INSTALL_BUFSIZE ? max : CONFIG_UTILS_OTA_INSTALL_BUFSIZE,
+        region, partsize, false);
+    tune->writesize = ota_tune_pick(path, fd, buf, geo->erasesize, max, region, partsize,
+        true);
+
+    free(buf);
+    close(fd);
+    return tune->writesize > 0 ? 0 : -EIO;
+}
+
+static void ota_tune_key(const char* path, char* key, size_t size)
+{
+    const char* name = strrchr(path, '/');
+
+    snprintf(key, size, OTA_TUNE_PREFIX "%s", name ? name + 1 : path);
+}
+
+/* the record of path if it matches the geometry, <0: measure again */
+
+static int ota_tune_load(const char* key, const struct mtd_geometry_s* geo,
+    struct ota_tune_s* tune)
+{
+    ssize_t ret;
+
+    if (geo->erasesize == 0 || geo->blocksize == 0) {
+        return -EINVAL;
+    }
+
+    ret = property_get_buffer(key, tune, sizeof(*tune));
+    if (ret == sizeof(*tune) && tune->erasesize == geo->erasesize
+        && tune->pagesize == geo->blocksize && tune->writesize > 0
+        && tune->writesize % geo->erasesize == 0) {
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+/* the sizes to write and read path with from persist.ota.tune.<xxx>,
+ * <0: not measured, keep the defaults
+ */
+
+int ota_tune(const char* path, const struct mtd_geometry_s* geo, size_t* writesize,
+    size_t* readsize)
+{
+    char key[PROP_NAME_MAX];
+    struct ota_tune_s tune;
+    int ret;
+
+    ota_tune_key(path, key, sizeof(key));
+    ret = ota_tune_load(key, geo, &tune);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *writesize = tune.writesize;
+    *readsize = tune.readsize;
+    return 0;
+}
+
+/* measure path unless it was already, called before the workers start
+ * and only for a partition nothing of the image was written to yet
+ */
+
+int ota_tune_calibrate(const char* path)
+{
+    struct mtd_geometry_s geo;
+    char key[PROP_NAME_MAX];
+    struct ota_tune_s tune;
+    uint64_t start;
+    ssize_t ret;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    /* not an mtd partition, nothing to tune */
+
+    ret = ioctl(fd, MTDIOC_GEOMETRY, (unsigned long)&geo);
+    close(fd);
+    if (ret < 0 || geo.erasesize == 0) {
+        return 0;
+    }
+
+    ota_tune_key(path, key, sizeof(key));
+    ret = ota_tune_load(key, &geo, &tune);
+    if (ret != -ENOENT) {
+        return ret;
+    }
+
+    memset(&tune, 0, sizeof(tune));
+    tune.erasesize = geo.erasesize;
+    tune.pagesize = geo.blocksize;
+
+    start = ota_tune_now();
+    ret = ota_tune_measure(path, &geo, &tune);
+    if (ret < 0) {
+        OTA_LOG(LOG_WARNING, "tune %s failed, ret: %zd", path, ret);
+        return ret;
+    }
+
+    OTA_LOG(LOG_INFO, "tune %s: erase %" PRIu32 ", page %" PRIu32 " -> write %" PRIu32
+        ", read %" PRIu32 ", %" PRIu64 " ms", path, tune.erasesize, tune.pagesize,
+        tune.writesize, tune.readsize, (ota_tune_now() - start) / 1000);
+
+    ret = property_set_buffer(key, &tune, sizeof(tune));
+    if (ret >= 0) {
+        ret = property_commit();
+    }
+
+    if (ret < 0) {
+        OTA_LOG(LOG_WARNING, "store %s failed, ret: %zd", key, ret);
+    }
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host benchmark of avb_verify()/avb_hash_desc() on file-backed partitions.
+ *
+ * libavb internals are timed through "ld --wrap", so only calls that cross
+ * a translation unit boundary are accounted (see Makefile).
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avb_rsa.h>
+#include <avb_sha.h>
+
+#include "avb_verify.h"
+
+#ifndef CONFIG_LIB_AVB_FOOTER_SEARCH_BLKSIZE
+#define CONFIG_LIB_AVB_FOOTER_SEARCH_BLKSIZE 0
+#endif
+
+struct avb_bench_timer_s {
+    uint32_t calls;
+    uint64_t usecs;
+};
+
+static struct avb_bench_timer_s g_footer_timer;
+static struct avb_bench_timer_s g_hash_timer;
+static struct avb_bench_timer_s g_rsa_timer;
+
+static uint64_t avb_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void avb_bench_account(struct avb_bench_timer_s* timer, uint64_t start)
+{
+    timer->calls++;
+    timer->usecs += avb_bench_now() - start;
+}
+
+AvbIOResult __real_avb_footer(AvbOps* ops, const char* partition, AvbFooter* footer);
+void __real_avb_sha256_update(AvbSHA256Ctx* ctx, const uint8_t* data, size_t len);
+void __real_avb_sha512_update(AvbSHA512Ctx* ctx, const uint8_t* data, size_t len);
+bool __real_avb_rsa_verify(const uint8_t* key, size_t key_num_bytes,
+    const uint8_t* sig, size_t sig_num_bytes,
+    const uint8_t* hash, size_t hash_num_bytes,
+    const uint8_t* padding, size_t padding_num_bytes);
+
+AvbIOResult __wrap_avb_footer(AvbOps* ops, const char* partition, AvbFooter* footer)
+{
+    uint64_t start = avb_bench_now();
+    AvbIOResult ret;
+
+    ret = __real_avb_footer(ops, partition, footer);
+    avb_bench_account(&g_footer_timer, start);
+    return ret;
+}
+
+void __wrap_avb_sha256_update(AvbSHA256Ctx* ctx, const uint8_t* data, size_t len)
+{
+    uint64_t start = avb_bench_now();
+
+    __real_avb_sha256_update(ctx, data, len);
+    avb_bench_account(&g_hash_timer, start);
+}
+
+void __wrap_avb_sha512_update(AvbSHA512Ctx* ctx, const uint8_t* data, size_t len)
+{
+    uint64_t start = avb_bench_now();
+
+    __real_avb_sha512_update(ctx, data, len);
+    avb_bench_account(&g_hash_timer, start);
+}
+
+bool __wrap_avb_rsa_verify(const uint8_t* key, size_t key_num_bytes,
+    const uint8_t* sig, size_t sig_num_bytes,
+    const uint8_t* hash, size_t hash_num_bytes,
+    const uint8_t* padding, size_t padding_num_bytes)
+{
+    uint64_t start = avb_bench_now();
+    bool ret;
+
+    ret = __real_avb_rsa_verify(key, key_num_bytes, sig, sig_num_bytes,
+        hash, hash_num_bytes, padding, padding_num_bytes);
+    avb_bench_account(&g_rsa_timer, start);
+    return ret;
+}
+
+static void avb_bench_reset(void)
+{
+    memset(&g_footer_timer, 0, sizeof(g_footer_timer));
+    memset(&g_hash_timer, 0, sizeof(g_hash_timer));
+    memset(&g_rsa_timer, 0, sizeof(g_rsa_timer));
+    avb_verify_stats_reset();
+}
+
+static void avb_bench_dump(const char* title, uint64_t usecs, int iterations)
+{
+    int i;
+
+    printf("  [%s] %" PRIu64 " us/iter\n", title, usecs / iterations);
+    printf("    %-24s %8s %12s %10s\n", "Callback", "Calls", "Bytes", "Time(us)");
+    for (i = 0; i < AVB_VERIFY_STAT_NR; i++) {
+        const struct avb_verify_stat_s* stat = avb_verify_stats_get(i);
+
+        if (stat->calls == 0)
+            continue;
+
+        printf("    %-24s %8" PRIu32 " %12" PRIu64 " %10" PRIu64 "\n",
+            avb_verify_stats_name(i), stat->calls / iterations,
+            stat->bytes / iterations, stat->usecs / iterations);
+    }
+
+    printf("    %-24s %8" PRIu32 " %12s %10" PRIu64 "\n", "footer search",
+        g_footer_timer.calls / iterations, "-", g_footer_timer.usecs / iterations);
+    printf("    %-24s %8" PRIu32 " %12s %10" PRIu64 "\n", "hash",
+        g_hash_timer.calls / iterations, "-", g_hash_timer.usecs / iterations);
+    printf("    %-24s %8" PRIu32 " %12s %10" PRIu64 "\n", "rsa",
+        g_rsa_timer.calls / iterations, "-", g_rsa_timer.usecs / iterations);
+}
+
+static int avb_bench_image(const char* image, const char* key, int iterations)
+{
+    struct avb_hash_desc_t desc;
+    uint64_t start;
+    uint64_t usecs;
+    int ret = 0;
+    int i;
+
+    printf("%s (footer search blksize %d)\n", image, CONFIG_LIB_AVB_FOOTER_SEARCH_BLKSIZE);
+
+    avb_bench_reset();
+    start = avb_bench_now();
+    for (i = 0; i < iterations && ret == 0; i++) {
+        ret = avb_hash_desc(image, &desc);
+    }
+
+    usecs = avb_bench_now() - start;
+    if (ret != 0) {
+        printf("  avb_hash_desc failed %d\n", ret);
+        return ret;
+    }
+
+    avb_bench_dump("avb_hash_desc", usecs, iterations);
+
+    avb_bench_reset();
+    start = avb_bench_now();
+    for (i = 0; i < iterations && ret == 0; i++) {
+        ret = avb_verify(image, key, NULL,
+            AVB_SLOT_VERIFY_FLAGS_NOT_UPDATE_ROLLBACK_INDEX);
+    }
+
+    usecs = avb_bench_now() - start;
+    if (ret != 0) {
+        printf("  avb_verify failed %d\n", ret);
+        return ret;
+    }
+
+    avb_bench_dump("avb_verify", usecs, iterations);
+    return 0;
+}
+
+static void usage(const char* progname)
+{
+    printf("Usage: %s [-n iterations] -k <key> <image> [image...]\n", progname);
+    printf("  -n iterations per image, default 10\n");
+    printf("  -k AVB public key (key.avb), several keys separated by ','\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* key = NULL;
+    int iterations = 10;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (key == NULL || optind >= argc || iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (; optind < argc; optind++) {
+        ret |= avb_bench_image(argv[optind], key, iterations);
+    }
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Forced include for building verify/avb_verify.c on a Linux host */
+
+#ifndef AVB_BENCH_HOST_CONFIG_H
+#define AVB_BENCH_HOST_CONFIG_H
+
+#include <string.h>
+
+#define CONFIG_UTILS_AVB_VERIFY_STATS 1
+#define CONFIG_UTILS_AVB_VERIFY_KEYRING_SIZE 4
+#define CONFIG_UTILS_AVB_VERIFY_TRUSTED_KEY_DIGEST ""
+
+/* No XIP on the host, get_preloaded_partition() always falls back to reads */
+
+#define BIOC_XIPBASE 0x7fff
+
+#if defined(__GLIBC__) && (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+static inline size_t strlcpy(char* dst, const char* src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+
+    return len;
+}
+#endif
+
+#endif /* AVB_BENCH_HOST_CONFIG_H */
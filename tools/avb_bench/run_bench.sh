@@ -0,0 +1,78 @@
+#! /bin/bash
+#
+# Copyright (C) 2024 Xiaomi Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+set -e
+
+readonly BENCH_PATH=$(dirname $(realpath $0))
+readonly SIGN=$BENCH_PATH/../avb_sign.sh
+readonly KEY=$BENCH_PATH/../keys/key.avb
+
+help(){
+  echo "Usage: $0 <image> <partition_size> [options]"
+  echo ""
+  echo "  <image>            Unsigned image, e.g. vela_ap.bin"
+  echo "  <partition_size>   Partition size (*1024) of the full-partition layout"
+  echo ""
+  echo "Options:"
+  echo "  [-b block_size]    avbtool --block_size of the dynamic layout, 8192 by default"
+  echo "  [-s search_blksz]  CONFIG_LIB_AVB_FOOTER_SEARCH_BLKSIZE to compare, repeatable"
+  echo "  [-n iterations]    Iterations per image, 10 by default"
+  exit 1
+}
+
+[[ $# -lt 2 ]] && help
+IMAGE=$(realpath $1)
+PARTITION_SIZE=$2
+shift; shift
+while getopts "b:s:n:" opt ; do
+  case $opt in
+    b)
+      BLOCK_SIZE=$OPTARG
+      ;;
+    s)
+      SEARCH_BLKSZ=(${SEARCH_BLKSZ[@]} $OPTARG)
+      ;;
+    n)
+      ITERATIONS=$OPTARG
+      ;;
+    ?)
+      help
+      ;;
+  esac
+done
+BLOCK_SIZE=${BLOCK_SIZE:-8192}
+SEARCH_BLKSZ=(${SEARCH_BLKSZ[@]:-8192})
+ITERATIONS=${ITERATIONS:-10}
+
+WORK=$(mktemp -d)
+trap "rm -rf $WORK" EXIT
+
+# The partition name in the descriptor must match the path passed to
+# avb_verify, so sign each copy with its own host path.
+
+cp $IMAGE $WORK/dynamic.bin
+$SIGN $WORK/dynamic.bin 0 -P $WORK/dynamic.bin \
+      -o --dynamic_partition_size -o "--block_size $BLOCK_SIZE" > /dev/null
+
+cp $IMAGE $WORK/full.bin
+$SIGN $WORK/full.bin $PARTITION_SIZE -P $WORK/full.bin > /dev/null
+
+for blksz in ${SEARCH_BLKSZ[@]} ; do
+  make -C $BENCH_PATH -s FOOTER_SEARCH_BLKSIZE=$blksz
+  $BENCH_PATH/build/$blksz/avb_bench -n $ITERATIONS -k $KEY \
+                                     $WORK/dynamic.bin $WORK/full.bin
+done
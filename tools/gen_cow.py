@@ -0,0 +1,95 @@
+#!/usr/bin/python3
+
+# coding: utf-8
+import os
+import sys
+import struct
+import argparse
+import zlib
+import logging
+
+program_description = \
+'''
+This program is used to generate a virtual A/B cow image
+
+it compares the image running in the base slot with the new image block
+by block and keeps only the changed blocks, bootctl boots them as a
+snapshot of the base slot and merges them after a successful boot
+
+<1> './gen_cow.py <old bin> <new bin> <cow bin>'
+
+<2> --block_size must be a multiple of the erase size of the base partition
+
+<3> name the output vela_<cow>.bin and put it into a full ota.zip with
+    gen_ota_zip.py, it is then written to /dev/<cow>
+'''
+
+COW_MAGIC = 0x574f4342 # "BCOW"
+COW_VERSION = 1
+
+logging.basicConfig(format = "[%(levelname)s]%(message)s")
+logger = logging.getLogger()
+
+def read_blocks(path, block_size, nblocks):
+    with open(path, 'rb') as f:
+        data = f.read()
+    return data.ljust(nblocks * block_size, b'\xff')
+
+def gen_cow(args):
+    block_size = args.block_size
+    old_size = os.stat(args.old).st_size
+    new_size = os.stat(args.new).st_size
+    nblocks = (max(old_size, new_size) + block_size - 1) // block_size
+    old = read_blocks(args.old, block_size, nblocks)
+    new = read_blocks(args.new, block_size, nblocks)
+
+    changed = []
+    for i in range(nblocks):
+        if old[i * block_size:(i + 1) * block_size] != new[i * block_size:(i + 1) * block_size]:
+            changed.append(i)
+
+    cow_map = struct.pack('<%dI' % len(changed), *changed)
+    header = struct.pack('<5I', COW_MAGIC, COW_VERSION, block_size, len(changed),
+                         zlib.crc32(cow_map))
+    header += struct.pack('<I', zlib.crc32(header))
+
+    # data starts at the first block boundary after the map
+    meta = header + cow_map
+    meta = meta.ljust((len(meta) + block_size - 1) // block_size * block_size, b'\xff')
+
+    with open(args.cow, 'wb') as f:
+        f.write(meta)
+        for i in changed:
+            f.write(new[i * block_size:(i + 1) * block_size])
+
+    logger.info("%d of %d blocks changed, cow size %d" %
+                (len(changed), nblocks, len(meta) + len(changed) * block_size))
+
+def main():
+    parser = argparse.ArgumentParser(description=program_description,\
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('--block_size',\
+                        help='cow block size, default 4096',\
+                        type=int,\
+                        default=4096)
+    parser.add_argument("--debug", action="store_true",
+                        help="print debug log")
+    parser.add_argument('old', help='image in the base slot')
+    parser.add_argument('new', help='new image')
+    parser.add_argument('cow', help='output cow image')
+    args = parser.parse_args()
+
+    if args.debug:
+        logger.setLevel(logging.DEBUG)
+    else:
+        logger.setLevel(logging.INFO)
+
+    if args.block_size <= 0 or args.block_size & (args.block_size - 1):
+        logger.error("block size must be a power of 2")
+        return 1
+
+    gen_cow(args)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -11,6 +11,12 @@ import logging
 import filecmp
 import configparser
 import re
+import struct
+import zlib
+import hashlib
+import subprocess
+import time
+import concurrent.futures
 
 program_description = \
 '''
@@ -32,6 +38,22 @@ you should make sure you have java environment to run apksigner
 
 <4> the bin name format must be vela_<xxx>.bin
     and in board must use mtd device named /dev/<xxx>
+
+<5> besides ota.sh, ota.zip carries ota.manifest, the same install plan
+    as binary operations for ota_install
+
+<6> --codec lz4/zstd/auto stores images as lz4 or zstd frames, they need
+    ota_install with CONFIG_UTILS_OTA_INSTALL_LZ4/ZSTD, ota.sh can not
+    install them. lz4 needs "pip install lz4", zstd "pip install zstandard"
+
+<7> --store <xxx> stores vela_<xxx>.bin uncompressed with its data on an
+    --align boundary of ota.zip, so the device can map it from the package
+
+<8> --stream <ota.stream> also writes ota.zip as a stream signed with
+    --stream_key, ota_install -s installs it from a pipe as it arrives
+
+<9> a diff ota.zip runs ddelta_generate for --jobs partitions at once,
+    one per cpu by default, --debug prints the time of each
 '''
 
 bin_path_help = \
@@ -44,6 +66,29 @@ patch_path = []
 bin_list = []
 tools_path=''
 speed_dict = {}
+
+# ota.manifest, see install/ota_install.h
+MANIFEST_MAGIC = 0x4e414d56 # "VMAN"
+MANIFEST_VERSION = 1
+MANIFEST_SKIP_VERSION_CHECK = 1
+MANIFEST_OP_WRITE = 1
+MANIFEST_OP_DELTA = 2
+MANIFEST_OP_VERIFY = 3
+MANIFEST_OP_HOOK = 4
+MANIFEST_HOOK_BEGIN = 0
+MANIFEST_HOOK_END = 1
+MANIFEST_NAME_MAX = 32
+MANIFEST_CODEC = {'deflate' : 0, 'lz4' : 1, 'zstd' : 2}
+CODEC_EXT = {'lz4' : '.lz4', 'zstd' : '.zst'}
+ZSTD_WINDOW_LOG = 17 # CONFIG_UTILS_OTA_INSTALL_ZSTD_WINDOWLOG
+ZIP_ALIGN_EXTRA_ID = 0xd935 # as zipalign and signapk -a
+
+# ota.stream, see install/ota_install.h
+STREAM_MAGIC = 0x52545356 # "VSTR"
+STREAM_VERSION = 1
+STREAM_SIG_SIZE = 256 # RSA2048
+decode_speed = {}
+
 logging.basicConfig(format = "[%(levelname)s]%(message)s")
 logger = logging.getLogger()
 
@@ -51,6 +96,186 @@ def get_file_size(path):
     stats = os.stat(path)
     return stats.st_size
 
+def get_file_crc(path):
+    with open(path, 'rb') as f:
+        return zlib.crc32(f.read())
+
+def codec_available(codec):
+    try:
+        if codec == 'lz4':
+            import lz4.frame
+        elif codec == 'zstd':
+            import zstandard
+    except ImportError:
+        return False
+    return True
+
+def encode_payload(data, codec):
+    if codec == 'lz4':
+        import lz4.frame
+        return lz4.frame.compress(data, compression_level=lz4.frame.COMPRESSIONLEVEL_MAX,
+                                  block_size=lz4.frame.BLOCKSIZE_MAX64KB,
+                                  content_checksum=False)
+    if codec == 'zstd':
+        import zstandard
+        params = zstandard.ZstdCompressionParameters.from_level(19, window_log=ZSTD_WINDOW_LOG)
+        return zstandard.ZstdCompressor(compression_params=params).compress(data)
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return compressor.compress(data) + compressor.flush()
+
+def write_stored(ota_zip, path, name, align):
+    '''
+    store path as name with its data on an align boundary of ota.zip,
+    padded in an alignment extra field like zipalign
+    '''
+    info = zipfile.ZipInfo.from_file(path, name)
+    info.compress_type = zipfile.ZIP_STORED
+    offset = ota_zip.fp.tell() + 30 + len(name.encode()) + 6
+    pad = -offset % align
+    info.extra = struct.pack('<HHH', ZIP_ALIGN_EXTRA_ID, 2 + pad, align) + b'\0' * pad
+    with open(path, 'rb') as f:
+        ota_zip.writestr(info, f.read())
+
+def zip_raw_entry(ota_zip, info):
+    '''the bytes of the entry as they are in the zip, deflated or stored'''
+    ota_zip.fp.seek(info.header_offset)
+    header = ota_zip.fp.read(30)
+    name_len, extra_len = struct.unpack('<HH', header[26:30])
+    ota_zip.fp.seek(info.header_offset + 30 + name_len + extra_len)
+    return ota_zip.fp.read(info.compress_size)
+
+def gen_stream(args):
+    '''
+    write ota.zip as an ota.stream: ota.manifest and the entries it uses
+    in install order, signed with --stream_key
+    '''
+    with zipfile.ZipFile(args.output) as ota_zip:
+        manifest = ota_zip.read('ota.manifest')
+        nops = struct.unpack('<H', manifest[6:8])[0]
+        hooks = {MANIFEST_HOOK_BEGIN : [], MANIFEST_HOOK_END : []}
+        names = []
+        for i in range(nops):
+            op = manifest[32 + i * 80 : 32 + (i + 1) * 80]
+            entry = op[16:48].rstrip(b'\0').decode()
+            if op[0] == MANIFEST_OP_HOOK:
+                hooks[op[1]].append(entry)
+            elif op[0] != MANIFEST_OP_VERIFY:
+                names.append(entry)
+
+        table = []
+        payloads = []
+        for name in hooks[MANIFEST_HOOK_BEGIN] + names + hooks[MANIFEST_HOOK_END]:
+            info = ota_zip.getinfo(name)
+            if info.compress_type not in (zipfile.ZIP_STORED, zipfile.ZIP_DEFLATED):
+                logger.error("%s can not be streamed" % name)
+                exit(-1)
+            data = zip_raw_entry(ota_zip, info)
+            table.append(struct.pack('<32sB3xIQQ32s', name.encode(), info.compress_type,
+                                     info.CRC, info.compress_size, info.file_size,
+                                     hashlib.sha256(data).digest()))
+            payloads.append(data)
+
+    header = struct.pack('<IHHII', STREAM_MAGIC, STREAM_VERSION, len(table),
+                         STREAM_SIG_SIZE, 0)
+    signed = header + manifest + b''.join(table)
+    ret = subprocess.run(['openssl', 'dgst', '-sha256', '-sign',
+                          '%s/%s' % (tools_path, args.stream_key)],
+                         input=signed, capture_output=True)
+    if ret.returncode != 0 or len(ret.stdout) != STREAM_SIG_SIZE:
+        logger.error("sign %s failed, it needs an RSA2048 key" % args.stream)
+        exit(-1)
+
+    with open(args.stream, 'wb') as f:
+        f.write(signed + ret.stdout)
+        for data in payloads:
+            f.write(data)
+    logger.info("%s, %d entries streamed" % (args.stream, len(table)))
+
+def parse_codec_conf(args):
+    if args.codecconf:
+        conf = configparser.ConfigParser()
+        conf.read(args.codecconf)
+        if not conf.has_section('speed') or not conf.has_option('speed', 'read'):
+            logger.error("pelase check codec conf file format!")
+            exit(-1)
+        for codec, speed in conf.items('speed'):
+            decode_speed[codec] = float(speed)
+
+def choose_codec(args, path):
+    '''
+    the codec installing path fastest: reading the payload plus decoding
+    the image at the speeds of --codecconf, without it the smallest payload
+    '''
+    codecs = ['deflate', 'lz4', 'zstd'] if args.codec == 'auto' else [args.codec]
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    best = None
+    for codec in codecs:
+        if not codec_available(codec):
+            if args.codec != 'auto':
+                logger.error("python module of %s is not installed" % codec)
+                exit(-1)
+            continue
+        if decode_speed and codec not in decode_speed:
+            continue
+        payload = encode_payload(data, codec)
+        if decode_speed:
+            cost = len(payload) / decode_speed['read'] + len(data) / decode_speed[codec]
+        else:
+            cost = len(payload)
+        logger.debug("%s %s: %d -> %d" % (path, codec, len(data), len(payload)))
+        if best is None or cost < best[0]:
+            best = (cost, codec, payload)
+
+    if best is None:
+        logger.error("no codec of %s in %s" % (codecs, args.codecconf))
+        exit(-1)
+    return best[1], best[2]
+
+def manifest_op(op_type, entry, target, size = 0, crc = 0, flags = 0):
+    for name in (entry, target):
+        if len(name.encode()) >= MANIFEST_NAME_MAX:
+            logger.error("%s is too long for ota.manifest" % name)
+            exit(-1)
+    return struct.pack('<BBHIQ32s32s', op_type, flags, 0, crc, size,
+                       entry.encode(), target.encode())
+
+def gen_manifest(ota_zip, ops, args, tmp_folder):
+    '''
+    ops: (type, entry, target, image) for write and delta, image is the
+    new image, (type, key, target) for verify
+    '''
+    data = []
+    total = 0
+
+    if args.user_begin_script:
+        ota_zip.write(args.user_begin_script, 'ota_begin.sh')
+        data.append(manifest_op(MANIFEST_OP_HOOK, 'ota_begin.sh', '', flags = MANIFEST_HOOK_BEGIN))
+
+    for op in ops:
+        if op[0] == MANIFEST_OP_VERIFY:
+            data.append(manifest_op(op[0], op[1], op[2]))
+            continue
+        size = get_file_size(op[3])
+        flags = op[4] if len(op) > 4 else 0
+        data.append(manifest_op(op[0], op[1], op[2], size, get_file_crc(op[3]), flags))
+        total += size
+
+    if args.user_end_script:
+        ota_zip.write(args.user_end_script, 'ota_end.sh')
+        data.append(manifest_op(MANIFEST_OP_HOOK, 'ota_end.sh', '', flags = MANIFEST_HOOK_END))
+
+    data = b''.join(data)
+    flags = MANIFEST_SKIP_VERSION_CHECK if args.skip_version_check else 0
+    header = struct.pack('<IHHIIQI', MANIFEST_MAGIC, MANIFEST_VERSION, len(data) // 80,
+                         args.version[0], flags, total, zlib.crc32(data))
+    header += struct.pack('<I', zlib.crc32(header))
+
+    with open('%s/ota.manifest' % tmp_folder, 'wb') as f:
+        f.write(header + data)
+    ota_zip.write('%s/ota.manifest' % tmp_folder, 'ota.manifest')
+
 def parse_speed_conf(args):
     if args.speedconf:
         conf = configparser.ConfigParser()
@@ -213,6 +438,23 @@ setprop ota.progress.current %d
 
     fd.close()
 
+def ddelta_generate(oldfile, newfile, patchfile, blksz):
+    cmd = ['%s/ddelta_generate' % tools_path, oldfile, newfile, patchfile]
+    if blksz != '0':
+        cmd.append(blksz)
+    start = time.monotonic()
+    ret = subprocess.run(cmd).returncode
+    return ret, time.monotonic() - start
+
+# every patch is its own ddelta_generate process, the pool only bounds
+# how many run at once; results come back in the order of jobs
+def ddelta_generate_all(jobs, args):
+    workers = max(1, min(args.jobs, len(jobs)))
+    with concurrent.futures.ThreadPoolExecutor(max_workers = workers) as pool:
+        futures = [pool.submit(ddelta_generate, job[2], job[3], job[4], args.blksz)
+                   for job in jobs]
+        return [future.result() for future in futures]
+
 def gen_diff_ota(args):
     tmp_folder = tempfile.TemporaryDirectory()
     os.makedirs("%s/patch" % (tmp_folder.name), exist_ok = True)
@@ -236,6 +478,7 @@ def gen_diff_ota(args):
 
     old_files[2].sort()
     new_files[2].sort()
+    jobs = []
     for i in range(len(old_files[2])):
         for j in range(len(new_files[2])):
             oldfile = '%s/%s' % (args.bin_path[0], old_files[2][i])
@@ -246,19 +489,22 @@ def gen_diff_ota(args):
                (filecmp.cmp(oldfile, newfile, shallow=False) != True or new_files[2][j][5:8] == 'ota'):
                 patchfile = '%s/patch/%spatch' % (tmp_folder.name, new_files[2][j][:-3])
                 logger.debug(patchfile)
-                if args.blksz == '0':
-                    ret = os.system("%s/ddelta_generate %s %s %s" % (tools_path, oldfile, newfile, patchfile))
-                else:
-                    ret = os.system("%s/ddelta_generate %s %s %s %s" % (tools_path, oldfile, newfile, patchfile, args.blksz))
-                if (ret != 0):
-                    logger.error("ddelta_generate error")
-                    exit(ret)
-                if new_files[2][j][5:8] != 'ota':
-                    ota_zip.write(patchfile, "%spatch" % new_files[2][j][:-3])
-                    patch_path.append('/dev/' + old_files[2][i][5:-4])
-                    bin_list.append(old_files[2][i])
-                else:
-                    ota_zip.write(newfile, new_files[2][j])
+                jobs.append((old_files[2][i], new_files[2][j], oldfile, newfile, patchfile))
+
+    # the patches are independent, generate them all at once and add them
+    # to ota.zip in the sorted order above
+    results = ddelta_generate_all(jobs, args)
+    for (oldname, newname, oldfile, newfile, patchfile), (ret, seconds) in zip(jobs, results):
+        logger.debug("ddelta_generate %s: %.2f s" % (newname, seconds))
+        if (ret != 0):
+            logger.error("ddelta_generate %s error" % newname)
+            exit(ret)
+        if newname[5:8] != 'ota':
+            ota_zip.write(patchfile, "%spatch" % newname[:-3])
+            patch_path.append('/dev/' + oldname[5:-4])
+            bin_list.append(oldname)
+        else:
+            ota_zip.write(newfile, newname)
 
     for file in newpartition_list:
         logger.debug("add %s",file)
@@ -272,6 +518,15 @@ def gen_diff_ota(args):
     gen_diff_ota_sh(patch_path, bin_list, newpartition_list, args, tmp_folder.name)
     ota_zip.write("%s/ota.sh" % tmp_folder.name, "ota.sh")
 
+    ops = []
+    for i in range(len(bin_list)):
+        ops.append((MANIFEST_OP_DELTA, '%spatch' % bin_list[i][:-3], patch_path[i],
+                    '%s/%s' % (args.bin_path[1], bin_list[i])))
+    for file in newpartition_list:
+        ops.append((MANIFEST_OP_WRITE, file, '/dev/' + file[5:-4],
+                    '%s/%s' % (args.bin_path[1], file)))
+    gen_manifest(ota_zip, ops, args, tmp_folder.name)
+
     if args.user_file:
         for user_file in args.user_file:
             if os.path.exists(user_file) == False:
@@ -431,15 +686,35 @@ def gen_full_ota(args):
     tmp_folder = tempfile.TemporaryDirectory()
     for new_files in os.walk("%s" % (args.bin_path[0])):pass
 
+    parse_codec_conf(args)
+    entry_list = []
     ota_zip = zipfile.ZipFile('%s' % args.output, 'w', compression=zipfile.ZIP_DEFLATED)
     for i in range(len(new_files[2])):
         if  new_files[2][i][0:5] == 'vela_' and (new_files[2][i][-4:] == '.elf' or new_files[2][i][-4:] == '.bin'):
             newfile = '%s/%s' % (args.bin_path[0], new_files[2][i])
             logger.debug("add %s" % newfile)
-            ota_zip.write(newfile, new_files[2][i])
-            if new_files[2][i][5:8] != 'ota':
+            if new_files[2][i][5:8] == 'ota':
+                ota_zip.write(newfile, new_files[2][i])
+                continue
+
+            if args.store and new_files[2][i][5:-4] in args.store:
+                write_stored(ota_zip, newfile, new_files[2][i], args.align)
+                entry_list.append((new_files[2][i], MANIFEST_CODEC['deflate']))
                 patch_path.append('/dev/' + new_files[2][i][5:-4])
                 bin_list.append(new_files[2][i])
+                continue
+
+            codec, payload = choose_codec(args, newfile)
+            if codec == 'deflate':
+                ota_zip.write(newfile, new_files[2][i])
+                entry_list.append((new_files[2][i], MANIFEST_CODEC[codec]))
+            else:
+                entry = new_files[2][i] + CODEC_EXT[codec]
+                logger.info("%s is stored as %s, only ota_install installs it" % (new_files[2][i], entry))
+                ota_zip.writestr(entry, payload, compress_type=zipfile.ZIP_STORED)
+                entry_list.append((entry, MANIFEST_CODEC[codec]))
+            patch_path.append('/dev/' + new_files[2][i][5:-4])
+            bin_list.append(new_files[2][i])
 
     for file in bin_list:
         speed_dict[file] = 1.0
@@ -448,6 +723,14 @@ def gen_full_ota(args):
 
     ota_zip.write("%s/ota.sh" % tmp_folder.name, "ota.sh")
 
+    ops = []
+    for i in range(len(bin_list)):
+        ops.append((MANIFEST_OP_WRITE, entry_list[i][0], patch_path[i],
+                    '%s/%s' % (args.bin_path[0], bin_list[i]), entry_list[i][1]))
+        if args.upgrade_verify and bin_list[i][5:-4] in args.upgrade_verify:
+            ops.append((MANIFEST_OP_VERIFY, '/etc/key.avb', patch_path[i]))
+    gen_manifest(ota_zip, ops, args, tmp_folder.name)
+
     if args.user_file:
         for user_file in args.user_file:
             if os.path.exists(user_file) == False:
@@ -475,8 +758,9 @@ def gen_full_ota(args):
             sign_output = args.output[0:n+1] + 'sign_' + args.output[n+1:]
         else:
             sign_output = 'sign_' + args.output
-        ret = os.system("java -jar %s/signapk.jar --min-sdk-version 0  %s/%s %s/%s\
-                       %s %s" % (tools_path, tools_path, args.cert,
+        align = '-a %d' % args.align if args.store else ''
+        ret = os.system("java -jar %s/signapk.jar %s --min-sdk-version 0  %s/%s %s/%s\
+                       %s %s" % (tools_path, align, tools_path, args.cert,
                                  tools_path, args.key, args.output, sign_output))
         if (ret != 0) :
             logger.error("sign error")
@@ -519,6 +803,11 @@ if __name__ == "__main__":
                              'if it not specified, non in-place patch will be used.',\
                         default='0')
 
+    parser.add_argument('--jobs',\
+                        help='ddelta_generate processes run at once, default: the number of cpus',\
+                        type=int,
+                        default=os.cpu_count() or 1)
+
     parser.add_argument('bin_path',\
                         help=bin_path_help,
                         nargs='*')
@@ -560,6 +849,38 @@ support many [xxx] to set different speed
 if don't have speedconf all bin speed is 1,or not,
 will bin size will multiply speed then calculate progress''')
 
+    parser.add_argument('--store',\
+                        help='partitions stored uncompressed and aligned, to be mapped from ota.zip',\
+                        nargs='*')
+
+    parser.add_argument('--align',\
+                        help='data alignment of --store entries in ota.zip',\
+                        type=int,
+                        default=4096)
+
+    parser.add_argument('--stream',\
+                        help='also write the package as an ota.stream to this path')
+
+    parser.add_argument('--stream_key',\
+                        help='RSA2048 key in pem format the ota.stream is signed with',\
+                        default='keys/key.pem')
+
+    parser.add_argument('--codec',\
+                        help='payload codec of full images, auto: the fastest of all by --codecconf',\
+                        choices=['deflate', 'lz4', 'zstd', 'auto'],
+                        default='deflate')
+
+    parser.add_argument("--codecconf",
+                        help='''
+set the decode speed profile of the device for --codec auto,
+conf file like:
+[speed]
+read=<MB/s reading ota.zip>
+deflate=<MB/s inflating>
+lz4=<MB/s>
+zstd=<MB/s>
+a codec not listed is not used''')
+
     parser.add_argument('--ota_tmp',\
                         help='save ota tmpfile path',\
                         default='/data/ota_tmp')
@@ -613,3 +934,7 @@ will bin size will multiply speed then calculate progress''')
         gen_full_ota(args)
     else:
         parser.print_help()
+        exit()
+
+    if args.stream:
+        gen_stream(args)
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Forced include for building install/ota_codec.c on a Linux host */
+
+#ifndef OTA_CODEC_TEST_HOST_CONFIG_H
+#define OTA_CODEC_TEST_HOST_CONFIG_H
+
+#define CONFIG_UTILS_OTA_INSTALL_LZ4 1
+#define CONFIG_UTILS_OTA_INSTALL_ZSTD 1
+#define CONFIG_UTILS_OTA_INSTALL_ZSTD_WINDOWLOG 17 /* as gen_ota_zip.py */
+#define CONFIG_UTILS_OTA_INSTALL_BUFSIZE 32768
+
+#endif /* OTA_CODEC_TEST_HOST_CONFIG_H */
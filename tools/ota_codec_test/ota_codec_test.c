@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test of ota_codec_read() (install/ota_codec.c).
+ *
+ * Multi-block lz4 and zstd frames, encoded like gen_ota_zip.py does, are
+ * decoded with input and output buffers smaller than one block, the way
+ * ota_install_entry() reads them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include "ota_install.h"
+
+/* the last zstd block is almost full, its output takes several reads */
+
+#define OTA_TEST_SIZE (1024 * 1024 - 4321)
+
+struct ota_test_src_s {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+};
+
+static int ota_test_read(void* handle, uint8_t* buf, size_t len)
+{
+    struct ota_test_src_s* src = handle;
+
+    if (len > src->size - src->pos) {
+        len = src->size - src->pos;
+    }
+
+    memcpy(buf, src->data + src->pos, len);
+    src->pos += len;
+    return len;
+}
+
+/* compressible, but not to a handful of bytes per block */
+
+static void ota_test_image(uint8_t* image, size_t size)
+{
+    uint32_t seed = 1;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (seed >> 16) % 3 ? "vela ota"[i % 8] : (seed >> 8);
+    }
+}
+
+/* as gen_ota_zip.py: 64 KiB blocks at the max level, no content checksum */
+
+static size_t ota_test_lz4(const uint8_t* image, size_t size, uint8_t** frame)
+{
+    LZ4F_preferences_t prefs;
+    size_t ret;
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.compressionLevel = LZ4F_compressionLevel_max();
+
+    *frame = malloc(LZ4F_compressFrameBound(size, &prefs));
+    ret = LZ4F_compressFrame(*frame, LZ4F_compressFrameBound(size, &prefs), image, size, &prefs);
+    return LZ4F_isError(ret) ? 0 : ret;
+}
+
+/* as gen_ota_zip.py: level 19 with the window of the installer */
+
+static size_t ota_test_zstd(const uint8_t* image, size_t size, uint8_t** frame)
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    size_t ret;
+
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 19);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, CONFIG_UTILS_OTA_INSTALL_ZSTD_WINDOWLOG);
+
+    *frame = malloc(ZSTD_compressBound(size));
+    ret = ZSTD_compress2(cctx, *frame, ZSTD_compressBound(size), image, size);
+    ZSTD_freeCCtx(cctx);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+/* decode the whole frame from bufsize chunks of the payload in reads of
+ * len bytes, 0: the image came out
+ */
+
+static int ota_test_decode(int type, const uint8_t* frame, size_t framesize,
+    const uint8_t* image, size_t size, size_t bufsize, size_t len)
+{
+    struct ota_test_src_s handle = { frame, framesize, 0 };
+    struct ota_src_s src = { ota_test_read, &handle };
+    struct ota_codec_s codec;
+    uint8_t* out;
+    size_t done = 0;
+    ssize_t ret;
+
+    out = malloc(size + len);
+    ret = ota_codec_open(&codec, &src, type, bufsize);
+    if (ret < 0) {
+        free(out);
+        return ret;
+    }
+
+    while ((ret = ota_codec_read(&codec, out + done, len)) > 0) {
+        done += ret;
+        if (done > size) {
+            ret = -E2BIG;
+            break;
+        }
+    }
+
+    ota_codec_close(&codec);
+    if (ret == 0 && (done != size || memcmp(out, image, size) != 0)) {
+        ret = -EILSEQ;
+    }
+
+    free(out);
+    return ret;
+}
+
+static int ota_test_run(const char* name, int type, const uint8_t* frame, size_t framesize,
+    const uint8_t* image, size_t size)
+{
+    static const size_t sizes[][2] = {
+        /* bufsize, read len */
+
+        { CONFIG_UTILS_OTA_INSTALL_BUFSIZE, CONFIG_UTILS_OTA_INSTALL_BUFSIZE },
+        { CONFIG_UTILS_OTA_INSTALL_BUFSIZE, 1000 },
+        { CONFIG_UTILS_OTA_INSTALL_BUFSIZE, 1 },
+        { 4096, 4096 },
+        { 1000, CONFIG_UTILS_OTA_INSTALL_BUFSIZE },
+        { 1, 1 },
+    };
+
+    int failed = 0;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ret = ota_test_decode(type, frame, framesize, image, size, sizes[i][0], sizes[i][1]);
+        printf("%-4s bufsize %-6zu len %-6zu whole frame: %s (%d)\n", name, sizes[i][0],
+            sizes[i][1], ret == 0 ? "ok" : "FAIL", ret);
+        failed += ret != 0;
+
+        /* a truncated frame must not end as a complete image */
+
+        ret = ota_test_decode(type, frame, framesize - 1, image, size, sizes[i][0], sizes[i][1]);
+        printf("%-4s bufsize %-6zu len %-6zu truncated:   %s (%d)\n", name, sizes[i][0],
+            sizes[i][1], ret < 0 && ret != -EILSEQ ? "ok" : "FAIL", ret);
+        failed += ret >= 0 || ret == -EILSEQ;
+    }
+
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    uint8_t* image;
+    uint8_t* frame;
+    size_t framesize;
+    int failed = 0;
+
+    image = malloc(OTA_TEST_SIZE);
+    ota_test_image(image, OTA_TEST_SIZE);
+
+    framesize = ota_test_lz4(image, OTA_TEST_SIZE, &frame);
+    printf("lz4  %d bytes in %zu\n", OTA_TEST_SIZE, framesize);
+    failed += framesize == 0
+        || ota_test_run("lz4", OTA_CODEC_LZ4, frame, framesize, image, OTA_TEST_SIZE);
+    free(frame);
+
+    framesize = ota_test_zstd(image, OTA_TEST_SIZE, &frame);
+    printf("zstd %d bytes in %zu\n", OTA_TEST_SIZE, framesize);
+    failed += framesize == 0
+        || ota_test_run("zstd", OTA_CODEC_ZSTD, frame, framesize, image, OTA_TEST_SIZE);
+    free(frame);
+
+    free(image);
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
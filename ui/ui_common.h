@@ -94,6 +94,14 @@ ui_result_code_e ui_page_hide(const char* page_name);
  */
 ui_result_code_e ui_set_progress(const char* page_name, uint32_t value);
 
+/**
+ * Set and update the time left shown under the progress
+ * @param page_name pointer to page width progress comp
+ * @param seconds time left, < 0 hides it
+ * @return code of ui_result_code_e
+ */
+ui_result_code_e ui_set_eta(const char* page_name, int32_t seconds);
+
 /**
  * Get page is exist
  * @param page_name pointer to page name
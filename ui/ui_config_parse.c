@@ -271,10 +271,13 @@ static int32_t json_progress_parse(cJSON* progress, lv_obj_t* page)
     cJSON* animation_fps = NULL;
     cJSON* animation_radius = NULL;
     cJSON* percentage_img = NULL;
+    cJSON* eta_color = NULL;
     cJSON* a_element = NULL;
     uint32_t img_map_len = 0;
+    uint32_t eta_rgb = 0xffffff;
     lv_obj_t* upgrade_obj = NULL;
     lv_obj_t* lv_progress_base_obj = NULL;
+    lv_obj_t* eta_label = NULL;
 
     static const string_map_t progress_mode_map[] = {
         { "number", PROGRESS_MODE_NUMBER },
@@ -315,6 +318,23 @@ static int32_t json_progress_parse(cJSON* progress, lv_obj_t* page)
 
     lv_upgrade_set_type(upgrade_obj, (lv_upgrade_type_e)mode_type);
 
+    /* the time left from ota.progress.eta, at the bottom of the progress
+     * area, hidden until ota_install publishes it
+     */
+    eta_color = cJSON_GetObjectItem(progress, "eta_color");
+    if (cJSON_IsString(eta_color)) {
+        eta_rgb = (uint32_t)strtoul(eta_color->valuestring, NULL, 16);
+    }
+
+    eta_label = lv_label_create(page);
+    lv_obj_set_style_text_color(eta_label, lv_color_hex(eta_rgb), 0);
+    lv_obj_set_style_text_align(eta_label, LV_TEXT_ALIGN_CENTER, 0);
+    lv_label_set_text(eta_label, "");
+    lv_obj_update_layout(upgrade_obj);
+    lv_obj_set_width(eta_label, lv_obj_get_width(upgrade_obj));
+    lv_obj_align_to(eta_label, upgrade_obj, LV_ALIGN_BOTTOM_MID, 0, 0);
+    lv_obj_add_flag(eta_label, LV_OBJ_FLAG_HIDDEN);
+
     animation_fps = cJSON_GetObjectItem(progress, "animation_fps");
     if (cJSON_IsNumber(animation_fps)) {
         lv_upgrade_set_animation_fps(upgrade_obj, animation_fps->valueint);
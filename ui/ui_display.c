@@ -174,6 +174,57 @@ ui_result_code_e ui_set_progress(const char* page_name, uint32_t value)
     return ui_refresh_page_progress(lv_page, value);
 }
 
+ui_result_code_e ui_set_eta(const char* page_name, int32_t seconds)
+{
+    char text[16];
+    lv_obj_t* eta_label = NULL;
+    int i;
+
+    if (!page_name) {
+        UI_LOG_ERROR("ota: ui page name null!\n");
+        return UI_PAGE_NAME_NULL;
+    }
+
+    lv_obj_t* lv_page = ui_find_page(page_name);
+    if (!lv_page) {
+        UI_LOG_ERROR("ota: ui page not found!\n");
+        return UI_PAGE_NOT_FOUND;
+    }
+
+    /* the eta label is the only lv_label of a progress page */
+    for (i = 0; i < lv_obj_get_child_cnt(lv_page); i++) {
+        lv_obj_t* obj = lv_obj_get_child(lv_page, i);
+        if (lv_obj_check_type(obj, &lv_label_class)) {
+            eta_label = obj;
+            break;
+        }
+    }
+
+    if (!eta_label) {
+        return UI_LV_OBJ_NULL;
+    }
+
+    if (seconds < 0) {
+        lv_obj_add_flag(eta_label, LV_OBJ_FLAG_HIDDEN);
+        return UI_SUCCESS;
+    }
+
+    if (seconds >= 3600) {
+        snprintf(text, sizeof(text), "%d:%02d:%02d", (int)(seconds / 3600),
+            (int)(seconds / 60 % 60), (int)(seconds % 60));
+    } else {
+        snprintf(text, sizeof(text), "%d:%02d", (int)(seconds / 60), (int)(seconds % 60));
+    }
+
+    /* only redraw when the text changed, this runs every tick */
+    if (strcmp(lv_label_get_text(eta_label), text) != 0) {
+        lv_label_set_text(eta_label, text);
+    }
+
+    lv_obj_clear_flag(eta_label, LV_OBJ_FLAG_HIDDEN);
+    return UI_SUCCESS;
+}
+
 bool ui_page_exist(const char* page_name)
 {
     if (!page_name) {
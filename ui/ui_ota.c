@@ -15,6 +15,7 @@
  */
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <kvdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,7 @@ typedef struct upgrade_progress_s {
     int32_t current;
     int32_t prev_node;
     int32_t next_node;
+    int32_t eta; /* seconds left from ota_install, -1: unknown */
 } upgrade_progress_t;
 
 static void ota_calc_progress(upgrade_progress_t* progress)
@@ -45,7 +47,9 @@ static void ota_calc_progress(upgrade_progress_t* progress)
         if (progress->current < progress->prev_node && fast_tick_count++ >= 2) {
             progress->current++;
             slow_tick_count = fast_tick_count = 0;
-        } else {
+        } else if (progress->eta < 0) {
+            /* only the progress nodes are known, creep towards the next one */
+
             if (progress->current < progress->next_node && slow_tick_count++ >= 100) {
                 progress->current++;
                 slow_tick_count = fast_tick_count = 0;
@@ -70,9 +74,22 @@ static int ota_upgrade_prop_get(const char* key)
 
 static void ota_sync_upgrade_progress(upgrade_progress_t* progress)
 {
+    char buf[16] = { 0 };
+    int32_t eta;
+
     if (progress) {
         progress->prev_node = ota_upgrade_prop_get("ota.progress.current");
         progress->next_node = ota_upgrade_prop_get("ota.progress.next");
+
+        /* ota_install publishes the bytes written, no need to guess */
+
+        property_get("ota.progress.eta", buf, "-1");
+        eta = strtol(buf, NULL, 10);
+        if (eta >= 0 && eta != progress->eta) {
+            UI_LOG_INFO("ota: %d%%, %" PRId32 "s left\n", (int)progress->prev_node, eta);
+        }
+
+        progress->eta = eta;
     }
 }
 
@@ -163,6 +180,7 @@ int main(int argc, char* argv[])
                 ret = ui_page_show(upgrading_page_name);
                 ota_calc_progress(&progress);
                 ret = ui_set_progress(upgrading_page_name, progress.current);
+                ui_set_eta(upgrading_page_name, progress.current >= 100 ? -1 : progress.eta);
 
                 if (ui_page_exist(upgrade_success_page_name) && progress.current >= 100) {
                     ret = ui_page_show(upgrade_success_page_name);
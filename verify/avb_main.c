@@ -15,11 +15,14 @@
  */
 
 #include "avb_verify.h"
+#include "verify_arena.h"
+#include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 void usage(const char* progname)
 {
-    avb_printf("Usage: %s [-b] [-c] [-i] <partition> <key> [suffix]\n", progname);
+    avb_printf("Usage: %s [-b] [-c] [-i] [-s] <partition> <key> [suffix]\n", progname);
     avb_printf("       %s [-I] <partition>\n", progname);
     avb_printf("Examples:\n");
     avb_printf("  1. Boot Verify\n");
@@ -28,14 +31,22 @@ void usage(const char* progname)
     avb_printf("     %s -c <image> <key> [suffix]\n", progname);
     avb_printf("  3. Image Info\n");
     avb_printf("     %s -I <image>\n", progname);
+#ifdef CONFIG_UTILS_AVB_VERIFY_STATS
+    avb_printf("  -s print AvbOps callback statistics\n");
+#endif
+#if CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE > 0
+    avb_printf("  -s print the peak use of the arena\n");
+#endif
+    avb_printf("<key> may list several trusted keys: <key1>,<key2>,...\n");
 }
 
-int main(int argc, char* argv[])
+static int avb_main(int argc, char* argv[], const struct verify_arena_s* arena)
 {
     AvbSlotVerifyFlags flags = 0;
+    bool stats = false;
     int ret;
 
-    while ((ret = getopt(argc, argv, "bchiI")) != -1) {
+    while ((ret = getopt(argc, argv, "bchiIs")) != -1) {
         switch (ret) {
         case 'b':
             break;
@@ -45,6 +56,9 @@ int main(int argc, char* argv[])
         case 'i':
             flags |= AVB_SLOT_VERIFY_FLAGS_ALLOW_ROLLBACK_INDEX_ERROR;
             break;
+        case 's':
+            stats = true;
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -77,5 +91,43 @@ int main(int argc, char* argv[])
     if (ret != 0)
         avb_printf("%s error %d\n", argv[0], ret);
 
+    if (stats) {
+#ifdef CONFIG_UTILS_AVB_VERIFY_STATS
+        avb_verify_stats_dump();
+#endif
+        if (arena != NULL)
+            avb_printf("%s: arena peak %zu of %zu bytes\n", argv[0], arena->peak,
+                arena->size);
+    }
+
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+#if CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE > 0
+    struct verify_arena_s arena;
+    void* base;
+    int ret;
+
+    /* one block for the whole run, taken before anything else */
+
+    base = malloc(CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+    if (base == NULL) {
+        avb_printf("%s: no memory for the %d byte arena\n", argv[0],
+            CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+        return -ENOMEM;
+    }
+
+    verify_arena_init(&arena, "CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE", base,
+        CONFIG_UTILS_AVB_VERIFY_ARENA_SIZE);
+    avb_verify_arena(&arena);
+
+    ret = avb_main(argc, argv, &arena);
+    avb_verify_arena(NULL);
+    free(base);
     return ret;
+#else
+    return avb_main(argc, argv, NULL);
+#endif
 }
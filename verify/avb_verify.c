@@ -14,25 +14,255 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #ifdef CONFIG_KVDB
 #include <kvdb.h>
 #endif
 #include <libavb.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <avb_sha.h>
+
 #include "avb_verify.h"
+#include "verify_arena.h"
 
 #define AVB_PERSISTENT_VALUE "persist.%s"
 #define AVB_DEVICE_UNLOCKED "persist.avb.unlocked"
 #define AVB_ROLLBACK_LOCATION "persist.avb.rollback.%zu"
 
+#define AVB_KEYRING_SIZE CONFIG_UTILS_AVB_VERIFY_KEYRING_SIZE
+#define AVB_KEYRING_SEPARATOR ","
+#define AVB_KEYRING_BUILTIN CONFIG_UTILS_AVB_VERIFY_TRUSTED_KEY_DIGEST
+#define AVB_KEYRING_READ_SIZE 256
+
+/* Trusted keys are kept as SHA-256 digests of the raw AVB public key, so
+ * a trust check is one hash of the presented key plus a constant-time
+ * compare against every entry. The key files are only stat()ed again, a
+ * file replaced since it was loaded reloads the keyring.
+ */
+
+struct avb_keyring_file_s {
+    off_t size;
+    time_t mtime;
+};
+
+struct avb_keyring_s {
+    char source[PATH_MAX]; /* key path(s) the keyring was loaded from */
+    size_t count;
+    size_t nfiles;
+    size_t checked; /* key files stat()ed by avb_keyring_check_file() */
+    struct avb_keyring_file_s file[AVB_KEYRING_SIZE];
+    uint8_t digest[AVB_KEYRING_SIZE][AVB_SHA256_DIGEST_SIZE];
+};
+
+static struct avb_keyring_s g_avb_keyring;
+
+/* With an arena set by avb_verify_arena(), images that are not mapped
+ * (XIP) are read into it instead of being allocated by libavb, and so is
+ * the vbmeta of avb_hash_desc(). It is emptied after every verification.
+ */
+
+static struct verify_arena_s* g_avb_arena;
+
+/* Verifications run one at a time, g_avb_verify_lock is held for the
+ * whole of avb_verify() and avb_hash_desc() and guards the keyring libavb
+ * reads as well as the arena.
+ */
+
+static pthread_mutex_t g_avb_verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void avb_keyring_digest(const uint8_t* data, size_t length, uint8_t* digest)
+{
+    AvbSHA256Ctx ctx;
+
+    avb_sha256_init(&ctx);
+    avb_sha256_update(&ctx, data, length);
+    memcpy(digest, avb_sha256_final(&ctx), AVB_SHA256_DIGEST_SIZE);
+}
+
+static int avb_keyring_add_digest(struct avb_keyring_s* keyring, const char* hex)
+{
+    uint8_t* digest;
+    size_t i;
+
+    if (keyring->count >= AVB_KEYRING_SIZE) {
+        avb_error("Keyring is full: ", hex, "\n");
+        return -ENOSPC;
+    }
+
+    if (strlen(hex) != AVB_SHA256_DIGEST_SIZE * 2) {
+        avb_error("Invalid key digest: ", hex, "\n");
+        return -EINVAL;
+    }
+
+    /* strtoul() would take spaces and signs, only hex digits are valid */
+
+    for (i = 0; i < AVB_SHA256_DIGEST_SIZE * 2; i++) {
+        if (!isxdigit((unsigned char)hex[i])) {
+            avb_error("Invalid key digest: ", hex, "\n");
+            return -EINVAL;
+        }
+    }
+
+    digest = keyring->digest[keyring->count];
+    for (i = 0; i < AVB_SHA256_DIGEST_SIZE; i++) {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+
+        digest[i] = strtoul(byte, NULL, 16);
+    }
+
+    keyring->count++;
+    return 0;
+}
+
+/* The key is hashed as it is read, nothing of it is kept. Only the key
+ * its header describes is hashed, which is what libavb presents, so a
+ * key file may carry more after it as before.
+ */
+
+static int avb_keyring_add_file(struct avb_keyring_s* keyring, const char* path)
+{
+    uint8_t data[AVB_KEYRING_READ_SIZE];
+    AvbRSAPublicKeyHeader header;
+    size_t length = SIZE_MAX;
+    struct stat buf;
+    AvbSHA256Ctx ctx;
+    size_t total = 0;
+    ssize_t nread;
+    int fd;
+
+    if (keyring->count >= AVB_KEYRING_SIZE) {
+        avb_error("Keyring is full: ", path, "\n");
+        return -ENOSPC;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        avb_error("Open key failed: ", path, "\n");
+        return -errno;
+    }
+
+    if (fstat(fd, &buf) < 0) {
+        close(fd);
+        return -errno;
+    }
+
+    avb_sha256_init(&ctx);
+    while (total < length && (nread = read(fd, data, sizeof(data))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -EIO;
+        }
+
+        if (total == 0 && (size_t)nread >= sizeof(header)) {
+            memcpy(&header, data, sizeof(header));
+            length = sizeof(header) + 2 * (avb_be32toh(header.key_num_bits) / 8);
+        }
+
+        if ((size_t)nread > length - total)
+            nread = length - total;
+
+        avb_sha256_update(&ctx, data, nread);
+        total += nread;
+    }
+
+    close(fd);
+    if (total == 0)
+        return -EINVAL;
+
+    keyring->file[keyring->nfiles].size = buf.st_size;
+    keyring->file[keyring->nfiles].mtime = buf.st_mtime;
+    keyring->nfiles++;
+    memcpy(keyring->digest[keyring->count++], avb_sha256_final(&ctx), AVB_SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+/* -ESTALE once a key file differs from the one loaded, the files are
+ * checked in the order they were loaded
+ */
+
+static int avb_keyring_check_file(struct avb_keyring_s* keyring, const char* path)
+{
+    const struct avb_keyring_file_s* file = &keyring->file[keyring->checked++];
+    struct stat buf;
+
+    if (stat(path, &buf) < 0 || buf.st_size != file->size || buf.st_mtime != file->mtime)
+        return -ESTALE;
+
+    return 0;
+}
+
+static int avb_keyring_add_list(struct avb_keyring_s* keyring, const char* list,
+    int (*add)(struct avb_keyring_s*, const char*))
+{
+    char token[PATH_MAX];
+    const char* end;
+    size_t len;
+    int ret = 0;
+
+    for (; *list != '\0' && ret == 0; list = *end ? end + 1 : end) {
+        end = list + strcspn(list, AVB_KEYRING_SEPARATOR);
+        len = end - list;
+        if (len == 0)
+            continue;
+        if (len >= sizeof(token))
+            return -ENAMETOOLONG;
+
+        memcpy(token, list, len);
+        token[len] = '\0';
+        ret = add(keyring, token);
+    }
+
+    return ret;
+}
+
+/* Load the keyring once per key argument, later calls with the same
+ * argument reuse the cached digests while the key files keep their size
+ * and mtime. Called with g_avb_verify_lock held, the keyring returned is
+ * valid until it is released.
+ */
+
+static const struct avb_keyring_s* avb_keyring_get(const char* key)
+{
+    struct avb_keyring_s* keyring = &g_avb_keyring;
+    const char* source = key ? key : "";
+    int ret = 0;
+
+    if (keyring->count > 0 && strcmp(keyring->source, source) == 0) {
+        keyring->checked = 0;
+        if (avb_keyring_add_list(keyring, source, avb_keyring_check_file) == 0)
+            return keyring;
+    }
+
+    memset(keyring, 0, sizeof(*keyring));
+    if (strlcpy(keyring->source, source, sizeof(keyring->source)) >= sizeof(keyring->source))
+        ret = -ENAMETOOLONG;
+
+    if (ret == 0)
+        ret = avb_keyring_add_list(keyring, AVB_KEYRING_BUILTIN, avb_keyring_add_digest);
+    if (ret == 0)
+        ret = avb_keyring_add_list(keyring, source, avb_keyring_add_file);
+    if (ret == 0 && keyring->count == 0)
+        ret = -ENOENT;
+
+    if (ret < 0)
+        keyring->count = 0;
+
+    return ret < 0 ? NULL : keyring;
+}
+
 static AvbIOResult read_from_partition(AvbOps* ops,
     const char* partition,
     int64_t offset,
@@ -88,6 +318,22 @@ static AvbIOResult get_preloaded_partition(AvbOps* ops,
 
     close(fd);
 
+    if (*out_pointer == NULL && g_avb_arena != NULL) {
+        AvbIOResult ret;
+
+        *out_pointer = verify_arena_alloc(g_avb_arena, num_bytes);
+        if (*out_pointer == NULL) {
+            avb_error(partition, ": image does not fit in the arena\n");
+            return AVB_IO_RESULT_ERROR_OOM;
+        }
+
+        ret = read_from_partition(ops, partition, 0, num_bytes, *out_pointer,
+            out_num_bytes_preloaded);
+        if (ret != AVB_IO_RESULT_OK)
+            *out_pointer = NULL;
+        return ret;
+    }
+
     *out_num_bytes_preloaded = *out_pointer ? num_bytes : 0;
     return AVB_IO_RESULT_OK;
 }
@@ -250,42 +496,265 @@ static AvbIOResult validate_public_key_for_partition(AvbOps* ops,
     bool* out_is_trusted,
     uint32_t* out_rollback_index_location)
 {
-    AvbIOResult result;
-    uint8_t* key_data;
-    size_t key_length;
+    const struct avb_keyring_s* keyring = ops->user_data;
+    uint8_t digest[AVB_SHA256_DIGEST_SIZE];
+    bool trusted = false;
+    size_t i;
+
+    avb_keyring_digest(public_key_data, public_key_length, digest);
 
-    key_data = calloc(1, public_key_length);
-    if (key_data == NULL)
-        return AVB_IO_RESULT_ERROR_OOM;
+    /* Walk every entry so the time taken does not depend on which key matched */
 
-    result = ops->read_from_partition(ops,
-        ops->user_data, 0, public_key_length, key_data, &key_length);
-    if (result == AVB_IO_RESULT_OK) {
-        *out_is_trusted = memcmp(key_data, public_key_data, public_key_length) == 0;
+    for (i = 0; i < keyring->count; i++) {
+        trusted |= avb_safe_memcmp(keyring->digest[i], digest, sizeof(digest)) == 0;
     }
 
-    free(key_data);
-    return result;
+    *out_is_trusted = trusted;
+    return AVB_IO_RESULT_OK;
+}
+
+#ifdef CONFIG_UTILS_AVB_VERIFY_STATS
+
+/* Accounting wrappers around the AvbOps callbacks */
+
+#define AVB_OP(name) name##_stat
+
+static struct avb_verify_stat_s g_avb_verify_stats[AVB_VERIFY_STAT_NR];
+
+static const char* const g_avb_verify_stat_names[AVB_VERIFY_STAT_NR] = {
+    "read_from_partition",
+    "get_preloaded_partition",
+    "write_to_partition",
+    "validate_public_key",
+    "read_rollback_index",
+    "write_rollback_index",
+    "read_is_device_unlocked",
+    "get_unique_guid",
+    "get_size_of_partition",
+    "read_persistent_value",
+    "write_persistent_value",
+};
+
+static uint64_t avb_stat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void avb_stat_account(int id, uint64_t start, uint64_t bytes)
+{
+    struct avb_verify_stat_s* stat = &g_avb_verify_stats[id];
+
+    stat->calls++;
+    stat->bytes += bytes;
+    stat->usecs += avb_stat_now() - start;
+}
+
+static AvbIOResult read_from_partition_stat(AvbOps* ops,
+    const char* partition,
+    int64_t offset,
+    size_t num_bytes,
+    void* buffer,
+    size_t* out_num_read)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = read_from_partition(ops, partition, offset, num_bytes, buffer, out_num_read);
+    avb_stat_account(AVB_VERIFY_STAT_READ_FROM_PARTITION, start,
+        ret == AVB_IO_RESULT_OK ? *out_num_read : 0);
+    return ret;
+}
+
+static AvbIOResult get_preloaded_partition_stat(AvbOps* ops,
+    const char* partition,
+    size_t num_bytes,
+    uint8_t** out_pointer,
+    size_t* out_num_bytes_preloaded)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = get_preloaded_partition(ops, partition, num_bytes, out_pointer, out_num_bytes_preloaded);
+    avb_stat_account(AVB_VERIFY_STAT_GET_PRELOADED_PARTITION, start,
+        ret == AVB_IO_RESULT_OK ? *out_num_bytes_preloaded : 0);
+    return ret;
+}
+
+static AvbIOResult write_to_partition_stat(AvbOps* ops,
+    const char* partition,
+    int64_t offset,
+    size_t num_bytes,
+    const void* buffer)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = write_to_partition(ops, partition, offset, num_bytes, buffer);
+    avb_stat_account(AVB_VERIFY_STAT_WRITE_TO_PARTITION, start,
+        ret == AVB_IO_RESULT_OK ? num_bytes : 0);
+    return ret;
+}
+
+static AvbIOResult read_rollback_index_stat(AvbOps* ops,
+    size_t rollback_index_location,
+    uint64_t* out_rollback_index)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = read_rollback_index(ops, rollback_index_location, out_rollback_index);
+    avb_stat_account(AVB_VERIFY_STAT_READ_ROLLBACK_INDEX, start, 0);
+    return ret;
+}
+
+static AvbIOResult write_rollback_index_stat(AvbOps* ops,
+    size_t rollback_index_location,
+    uint64_t rollback_index)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = write_rollback_index(ops, rollback_index_location, rollback_index);
+    avb_stat_account(AVB_VERIFY_STAT_WRITE_ROLLBACK_INDEX, start, 0);
+    return ret;
+}
+
+static AvbIOResult read_is_device_unlocked_stat(AvbOps* ops, bool* out_is_unlocked)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = read_is_device_unlocked(ops, out_is_unlocked);
+    avb_stat_account(AVB_VERIFY_STAT_READ_IS_DEVICE_UNLOCKED, start, 0);
+    return ret;
+}
+
+static AvbIOResult get_unique_guid_for_partition_stat(AvbOps* ops,
+    const char* partition,
+    char* guid_buf,
+    size_t guid_buf_size)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = get_unique_guid_for_partition(ops, partition, guid_buf, guid_buf_size);
+    avb_stat_account(AVB_VERIFY_STAT_GET_UNIQUE_GUID, start, 0);
+    return ret;
+}
+
+static AvbIOResult get_size_of_partition_stat(AvbOps* ops,
+    const char* partition,
+    uint64_t* out_size_num_bytes)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = get_size_of_partition(ops, partition, out_size_num_bytes);
+    avb_stat_account(AVB_VERIFY_STAT_GET_SIZE_OF_PARTITION, start, 0);
+    return ret;
+}
+
+static AvbIOResult read_persistent_value_stat(AvbOps* ops,
+    const char* name,
+    size_t buffer_size,
+    uint8_t* out_buffer,
+    size_t* out_num_bytes_read)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = read_persistent_value(ops, name, buffer_size, out_buffer, out_num_bytes_read);
+    avb_stat_account(AVB_VERIFY_STAT_READ_PERSISTENT_VALUE, start,
+        ret == AVB_IO_RESULT_OK ? *out_num_bytes_read : 0);
+    return ret;
+}
+
+static AvbIOResult write_persistent_value_stat(AvbOps* ops,
+    const char* name,
+    size_t value_size,
+    const uint8_t* value)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = write_persistent_value(ops, name, value_size, value);
+    avb_stat_account(AVB_VERIFY_STAT_WRITE_PERSISTENT_VALUE, start, value_size);
+    return ret;
+}
+
+static AvbIOResult validate_public_key_for_partition_stat(AvbOps* ops,
+    const char* partition,
+    const uint8_t* public_key_data,
+    size_t public_key_length,
+    const uint8_t* public_key_metadata,
+    size_t public_key_metadata_length,
+    bool* out_is_trusted,
+    uint32_t* out_rollback_index_location)
+{
+    uint64_t start = avb_stat_now();
+    AvbIOResult ret;
+
+    ret = validate_public_key_for_partition(ops, partition, public_key_data,
+        public_key_length, public_key_metadata, public_key_metadata_length,
+        out_is_trusted, out_rollback_index_location);
+    avb_stat_account(AVB_VERIFY_STAT_VALIDATE_PUBLIC_KEY, start, public_key_length);
+    return ret;
 }
 
+void avb_verify_stats_reset(void)
+{
+    memset(g_avb_verify_stats, 0, sizeof(g_avb_verify_stats));
+}
+
+const struct avb_verify_stat_s* avb_verify_stats_get(int id)
+{
+    return id >= 0 && id < AVB_VERIFY_STAT_NR ? &g_avb_verify_stats[id] : NULL;
+}
+
+const char* avb_verify_stats_name(int id)
+{
+    return id >= 0 && id < AVB_VERIFY_STAT_NR ? g_avb_verify_stat_names[id] : NULL;
+}
+
+void avb_verify_stats_dump(void)
+{
+    int i;
+
+    avb_printf("%-24s %8s %12s %10s\n", "Callback", "Calls", "Bytes", "Time(us)");
+    for (i = 0; i < AVB_VERIFY_STAT_NR; i++) {
+        const struct avb_verify_stat_s* stat = &g_avb_verify_stats[i];
+
+        avb_printf("%-24s %8" PRIu32 " %12" PRIu64 " %10" PRIu64 "\n",
+            g_avb_verify_stat_names[i], stat->calls, stat->bytes, stat->usecs);
+    }
+}
+
+#else
+#define AVB_OP(name) name
+#endif
+
 int avb_verify(const char* partition, const char* key, const char* suffix, AvbSlotVerifyFlags flags)
 {
+    const struct avb_keyring_s* keyring;
     struct AvbOps ops = {
-        (char*)key,
         NULL,
         NULL,
-        read_from_partition,
-        get_preloaded_partition,
-        write_to_partition,
+        NULL,
+        AVB_OP(read_from_partition),
+        AVB_OP(get_preloaded_partition),
+        AVB_OP(write_to_partition),
         validate_vbmeta_public_key,
-        read_rollback_index,
-        write_rollback_index,
-        read_is_device_unlocked,
-        get_unique_guid_for_partition,
-        get_size_of_partition,
-        read_persistent_value,
-        write_persistent_value,
-        validate_public_key_for_partition
+        AVB_OP(read_rollback_index),
+        AVB_OP(write_rollback_index),
+        AVB_OP(read_is_device_unlocked),
+        AVB_OP(get_unique_guid_for_partition),
+        AVB_OP(get_size_of_partition),
+        AVB_OP(read_persistent_value),
+        AVB_OP(write_persistent_value),
+        AVB_OP(validate_public_key_for_partition)
     };
     const char* partitions[] = {
         partition,
@@ -295,6 +764,14 @@ int avb_verify(const char* partition, const char* key, const char* suffix, AvbSl
     int ret;
     int n;
 
+    pthread_mutex_lock(&g_avb_verify_lock);
+    keyring = avb_keyring_get(key);
+    if (keyring == NULL) {
+        pthread_mutex_unlock(&g_avb_verify_lock);
+        return AVB_SLOT_VERIFY_RESULT_ERROR_PUBLIC_KEY_REJECTED;
+    }
+
+    ops.user_data = (void*)keyring;
     ret = avb_slot_verify(&ops,
         partitions, suffix ? suffix : "",
         flags | AVB_SLOT_VERIFY_FLAGS_NO_VBMETA_PARTITION,
@@ -302,7 +779,7 @@ int avb_verify(const char* partition, const char* key, const char* suffix, AvbSl
         &slot_data);
 
     if (ret != AVB_SLOT_VERIFY_RESULT_OK || !slot_data)
-        return ret;
+        goto out;
 
     for (n = 0; n < AVB_MAX_NUMBER_OF_ROLLBACK_INDEX_LOCATIONS; n++) {
         uint64_t rollback_index = slot_data->rollback_indexes[n];
@@ -320,7 +797,11 @@ int avb_verify(const char* partition, const char* key, const char* suffix, AvbSl
     }
 
 out:
-    avb_slot_verify_data_free(slot_data);
+    if (slot_data)
+        avb_slot_verify_data_free(slot_data);
+    if (g_avb_arena)
+        verify_arena_reset(g_avb_arena);
+    pthread_mutex_unlock(&g_avb_verify_lock);
     return ret;
 }
 
@@ -330,15 +811,15 @@ int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc)
         NULL,
         NULL,
         NULL,
-        read_from_partition,
-        get_preloaded_partition,
+        AVB_OP(read_from_partition),
+        AVB_OP(get_preloaded_partition),
         NULL,
         validate_vbmeta_public_key,
-        read_rollback_index,
+        AVB_OP(read_rollback_index),
         NULL,
-        read_is_device_unlocked,
-        get_unique_guid_for_partition,
-        get_size_of_partition,
+        AVB_OP(read_is_device_unlocked),
+        AVB_OP(get_unique_guid_for_partition),
+        AVB_OP(get_size_of_partition),
         NULL,
         NULL,
         NULL
@@ -347,7 +828,7 @@ int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc)
     size_t vbmeta_num_read;
     uint8_t* vbmeta_buf = NULL;
     size_t num_descriptors;
-    const AvbDescriptor** descriptors;
+    const AvbDescriptor** descriptors = NULL;
     AvbDescriptor avb_desc;
     int ret;
 
@@ -357,9 +838,14 @@ int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc)
         return ret;
     }
 
-    vbmeta_buf = avb_malloc(footer.vbmeta_size);
+    pthread_mutex_lock(&g_avb_verify_lock);
+    if (g_avb_arena)
+        vbmeta_buf = verify_arena_alloc(g_avb_arena, footer.vbmeta_size);
+    else
+        vbmeta_buf = avb_malloc(footer.vbmeta_size);
     if (vbmeta_buf == NULL) {
-        return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+        ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+        goto out;
     }
 
     ret = ops.read_from_partition(&ops,
@@ -377,6 +863,11 @@ int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc)
         &vbmeta_header);
 
     descriptors = avb_descriptor_get_all(vbmeta_buf, vbmeta_num_read, &num_descriptors);
+    if (descriptors == NULL || num_descriptors == 0) {
+        ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+        goto out;
+    }
+
     if (!avb_descriptor_validate_and_byteswap(descriptors[0], &avb_desc)) {
         avb_error(full_partition_name, ": Descriptor is invalid.\n");
         ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
@@ -416,11 +907,23 @@ int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc)
     }
 
 out:
-    if (vbmeta_buf)
+    if (descriptors)
+        avb_free(descriptors);
+    if (g_avb_arena)
+        verify_arena_reset(g_avb_arena);
+    else if (vbmeta_buf)
         avb_free(vbmeta_buf);
+    pthread_mutex_unlock(&g_avb_verify_lock);
     return ret;
 }
 
+void avb_verify_arena(struct verify_arena_s* arena)
+{
+    pthread_mutex_lock(&g_avb_verify_lock);
+    g_avb_arena = arena;
+    pthread_mutex_unlock(&g_avb_verify_lock);
+}
+
 void avb_hash_desc_dump(const struct avb_hash_desc_t* desc)
 {
     int i;
@@ -30,10 +30,46 @@ struct avb_hash_desc_t {
     uint8_t digest[64]; /* Max: sha512 */
 };
 
+#ifdef CONFIG_UTILS_AVB_VERIFY_STATS
+enum avb_verify_stat_e {
+    AVB_VERIFY_STAT_READ_FROM_PARTITION,
+    AVB_VERIFY_STAT_GET_PRELOADED_PARTITION,
+    AVB_VERIFY_STAT_WRITE_TO_PARTITION,
+    AVB_VERIFY_STAT_VALIDATE_PUBLIC_KEY,
+    AVB_VERIFY_STAT_READ_ROLLBACK_INDEX,
+    AVB_VERIFY_STAT_WRITE_ROLLBACK_INDEX,
+    AVB_VERIFY_STAT_READ_IS_DEVICE_UNLOCKED,
+    AVB_VERIFY_STAT_GET_UNIQUE_GUID,
+    AVB_VERIFY_STAT_GET_SIZE_OF_PARTITION,
+    AVB_VERIFY_STAT_READ_PERSISTENT_VALUE,
+    AVB_VERIFY_STAT_WRITE_PERSISTENT_VALUE,
+    AVB_VERIFY_STAT_NR
+};
+
+struct avb_verify_stat_s {
+    uint32_t calls;
+    uint64_t bytes; /* bytes transferred by the callback */
+    uint64_t usecs; /* time spent inside the callback */
+};
+#endif
+
+struct verify_arena_s;
+
 int avb_verify(const char* partition, const char* key, const char* suffix, AvbSlotVerifyFlags flags);
 int avb_hash_desc(const char* full_partition_name, struct avb_hash_desc_t* desc);
 void avb_hash_desc_dump(const struct avb_hash_desc_t* desc);
 
+/* read images and vbmeta into arena instead of the heap, NULL: the heap */
+
+void avb_verify_arena(struct verify_arena_s* arena);
+
+#ifdef CONFIG_UTILS_AVB_VERIFY_STATS
+void avb_verify_stats_reset(void);
+const struct avb_verify_stat_s* avb_verify_stats_get(int id);
+const char* avb_verify_stats_name(int id);
+void avb_verify_stats_dump(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <syslog.h>
+
+#include "verify_arena.h"
+
+#define VERIFY_ARENA_ALIGN sizeof(uint64_t)
+
+void verify_arena_init(struct verify_arena_s* arena, const char* name, void* base,
+    size_t size)
+{
+    arena->name = name;
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+/* NULL once the budget is spent, the error names what to raise */
+
+void* verify_arena_alloc(struct verify_arena_s* arena, size_t size)
+{
+    size_t used = (arena->used + VERIFY_ARENA_ALIGN - 1) & ~(VERIFY_ARENA_ALIGN - 1);
+    void* ptr;
+
+    if (used > arena->size || size > arena->size - used) {
+        syslog(LOG_ERR, "arena: %zu bytes needed, %zu of %zu left, raise %s\n", size,
+            arena->size - (used < arena->size ? used : arena->size), arena->size,
+            arena->name);
+        return NULL;
+    }
+
+    ptr = arena->base + used;
+    arena->used = used + size;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+
+    return ptr;
+}
+
+size_t verify_arena_mark(const struct verify_arena_s* arena)
+{
+    return arena->used;
+}
+
+/* give back everything allocated after mark */
+
+void verify_arena_release(struct verify_arena_s* arena, size_t mark)
+{
+    if (mark < arena->used) {
+        arena->used = mark;
+    }
+}
+
+void verify_arena_reset(struct verify_arena_s* arena)
+{
+    arena->used = 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VERIFY_ARENA_H
+#define VERIFY_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A fixed budget the verify tools allocate from instead of the heap.
+ * Allocations are bumped from the start and only given back all at once
+ * with verify_arena_reset() or down to a mark, so a long uptime can not
+ * fragment it. Running out is reported with the bytes missing.
+ */
+
+struct verify_arena_s {
+    const char* name; /* the Kconfig option sizing it, for the error */
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
+
+void verify_arena_init(struct verify_arena_s* arena, const char* name, void* base,
+    size_t size);
+void* verify_arena_alloc(struct verify_arena_s* arena, size_t size);
+size_t verify_arena_mark(const struct verify_arena_s* arena);
+void verify_arena_release(struct verify_arena_s* arena, size_t mark);
+void verify_arena_reset(struct verify_arena_s* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VERIFY_ARENA_H */
@@ -27,13 +27,18 @@
 #include <sys/stat.h>
 #include <syslog.h>
 #include <unistd.h>
-#include <unzip.h>
 
 #include <avb_rsa.h>
 #include <avb_sha.h>
 
+#include "verify_arena.h"
+
 #define DIGESTED_CHUNK_MAX_SIZE (1024 * 1024)
 
+#define EOCD_MAGIC 0x06054b50
+#define EOCD_SIZE 22
+#define EOCD_COMMENT_MAX 0xffff
+
 #define assert_res(x, ...)                                                          \
     do {                                                                            \
         if (!(x)) {                                                                 \
@@ -135,14 +140,12 @@ static uint8_t* parse_kv_block(uint8_t* data, uint64_t* key, uint8_t** value)
 /**
  * @brief Get all block data of app
  */
-static app_block_t* parse_app_block(const char* app_path, size_t comment_len)
+static int parse_app_block(const char* app_path, size_t comment_len, app_block_t* app_block)
 {
     int fd = -1;
     int res = -1;
     char magic_buf[16] = { 0 };
     const char* magic = "APK Sig Block 42";
-    app_block_t* app_block = malloc(sizeof(app_block_t));
-    assert_res(app_block != NULL);
 
     fd = open(app_path, O_RDONLY);
     assert_res(fd > 0);
@@ -186,12 +189,11 @@ static app_block_t* parse_app_block(const char* app_path, size_t comment_len)
     app_block->data_block.length = (uintptr_t)app_block->signature_block.data - 8;
 
     close(fd);
-    return app_block;
+    return 0;
 
 error:
     close(fd);
-    free(app_block);
-    return NULL;
+    return -1;
 }
 
 /**
@@ -313,7 +315,8 @@ error:
 /**
  * @brief Verify the app digest
  */
-static int verify_digest(const char* path, app_block_t* app_block, data_block_t* digest)
+static int verify_digest(struct verify_arena_s* arena, const char* path, app_block_t* app_block,
+    data_block_t* digest)
 {
     int res = -1;
     int chunk_count = 0;
@@ -333,15 +336,17 @@ static int verify_digest(const char* path, app_block_t* app_block, data_block_t*
     avb_sha256_update(&ctx, &prefix, 1);
     avb_sha256_update(&ctx, (const unsigned char*)&chunk_count, sizeof(chunk_count));
 
-    buf = malloc(CONFIG_UTILS_ZIP_VERIFY_BUFSIZE);
+    buf = verify_arena_alloc(arena, CONFIG_UTILS_ZIP_VERIFY_BUFSIZE);
     assert_res(buf != NULL);
     md_file_block(&ctx, fd, &app_block->data_block, buf, CONFIG_UTILS_ZIP_VERIFY_BUFSIZE);
     md_file_block(&ctx, fd, &app_block->central_directory_block, buf, CONFIG_UTILS_ZIP_VERIFY_BUFSIZE);
 
     // Modify central directory offset
     prefix = 0xa5;
-    buf = realloc(buf, app_block->eocd_block.length);
-    assert_res(buf != NULL);
+    if (app_block->eocd_block.length > CONFIG_UTILS_ZIP_VERIFY_BUFSIZE) {
+        buf = verify_arena_alloc(arena, app_block->eocd_block.length);
+        assert_res(buf != NULL);
+    }
     res = lseek(fd, (intptr_t)app_block->eocd_block.data, SEEK_SET);
     assert_res(res == (intptr_t)app_block->eocd_block.data);
     res = read(fd, buf, app_block->eocd_block.length);
@@ -360,7 +365,6 @@ static int verify_digest(const char* path, app_block_t* app_block, data_block_t*
 
 error:
 
-    free(buf);
     close(fd);
 
     return res;
@@ -369,12 +373,13 @@ error:
 /**
  * @brief app Signature verification
  */
-static int verify_app(const char* app_path, const char* cert_path, size_t comment_len)
+static int verify_app(struct verify_arena_s* arena, const char* app_path, const char* cert_path,
+    size_t comment_len)
 {
     int res = -1, fd = -1;
     uint64_t id;
     uint8_t* offset;
-    app_block_t* app_block = NULL;
+    app_block_t app_block;
     uint8_t* signature_block_data = NULL;
     data_block_t signature_data;
     signature_block_t signature_info;
@@ -382,16 +387,17 @@ static int verify_app(const char* app_path, const char* cert_path, size_t commen
     struct stat buf;
 
     // get APK Signing Block
-    app_block = parse_app_block(app_path, comment_len);
-    assert_res(app_block != NULL);
+    res = parse_app_block(app_path, comment_len, &app_block);
+    assert_res(res == 0);
 
     // parse Signing Block
-    signature_block_data = malloc(app_block->signature_block.length);
+    res = -1;
+    signature_block_data = verify_arena_alloc(arena, app_block.signature_block.length);
     assert_res(signature_block_data != NULL);
     fd = open(app_path, O_RDONLY);
     assert_res(fd > 0);
-    lseek(fd, (uintptr_t)app_block->signature_block.data, SEEK_SET);
-    read(fd, signature_block_data, app_block->signature_block.length);
+    lseek(fd, (uintptr_t)app_block.signature_block.data, SEEK_SET);
+    read(fd, signature_block_data, app_block.signature_block.length);
     close(fd);
 
     parse_kv_block(signature_block_data, &id, &offset);
@@ -405,46 +411,100 @@ static int verify_app(const char* app_path, const char* cert_path, size_t commen
     res = stat(cert_path, &buf);
     assert_res(res == 0);
 
+    res = -1;
+    avbkey.data = verify_arena_alloc(arena, buf.st_size);
+    assert_res(avbkey.data != NULL);
     fd = open(cert_path, O_RDONLY);
     assert_res(fd > 0);
-    avbkey.data = malloc(buf.st_size);
     avbkey.length = read(fd, avbkey.data, buf.st_size);
     close(fd);
 
     res = verify_signature(&avbkey, &signature_info.signed_data,
         &signature_info.signatures_content);
-    free(avbkey.data);
     assert_res(res == 0);
 
     // Compare whether the app summary is consistent with the signature block summary
-    res = verify_digest(app_path, app_block, &signature_info.one_digest);
+    res = verify_digest(arena, app_path, &app_block, &signature_info.one_digest);
     assert_res(res == 0);
 
 error:
-    if (signature_block_data)
-        free(signature_block_data);
-    if (app_block)
-        free(app_block);
     return res;
 }
 
-static int verify(const char* app_path, const char* cert_path)
+/**
+ * @brief Find the end of central directory record, its comment length
+ */
+static int find_eocd(struct verify_arena_s* arena, const char* app_path, size_t* comment_len)
 {
-    unzFile zFile;
-    unz_global_info64 zGlobalInfo;
+    int res = -1, fd = -1;
+    uint8_t eocd[EOCD_SIZE];
+    uint8_t* tail = NULL;
+    off_t size, lowest, start, end;
+    uint32_t magic;
+    uint16_t comment;
+    size_t mark = verify_arena_mark(arena);
+
+    fd = open(app_path, O_RDONLY);
+    assert_res(fd >= 0);
+    size = lseek(fd, 0, SEEK_END);
+    assert_res(size >= EOCD_SIZE, "file format error");
+
+    // Packages have no comment, the record ends the file
+    lseek(fd, size - EOCD_SIZE, SEEK_SET);
+    assert_res(read(fd, eocd, EOCD_SIZE) == EOCD_SIZE);
+    memcpy(&magic, eocd, sizeof(magic));
+    memcpy(&comment, eocd + EOCD_SIZE - 2, sizeof(comment));
+    if (magic == EOCD_MAGIC && comment == 0) {
+        *comment_len = 0;
+        res = 0;
+        goto error;
+    }
+
+    // Otherwise it is followed by a comment of up to 64KiB, scanned from
+    // the end a read buffer at a time
+    tail = verify_arena_alloc(arena, CONFIG_UTILS_ZIP_VERIFY_BUFSIZE);
+    assert_res(tail != NULL);
+    lowest = size > EOCD_SIZE + EOCD_COMMENT_MAX ? size - EOCD_SIZE - EOCD_COMMENT_MAX : 0;
+    for (end = size; res != 0 && end - lowest >= EOCD_SIZE; end = start + EOCD_SIZE - 1) {
+        start = end - lowest > CONFIG_UTILS_ZIP_VERIFY_BUFSIZE ? end - CONFIG_UTILS_ZIP_VERIFY_BUFSIZE : lowest;
+        lseek(fd, start, SEEK_SET);
+        assert_res(read(fd, tail, end - start) == end - start);
+
+        for (off_t i = end - start - EOCD_SIZE; i >= 0; i--) {
+            memcpy(&magic, tail + i, sizeof(magic));
+            memcpy(&comment, tail + i + EOCD_SIZE - 2, sizeof(comment));
+            if (magic == EOCD_MAGIC && start + i + EOCD_SIZE + comment == size) {
+                *comment_len = comment;
+                res = 0;
+                break;
+            }
+        }
+
+        if (start == lowest)
+            break;
+    }
+
+    assert_res(res == 0, "file format error");
+
+error:
+    verify_arena_release(arena, mark);
+    if (fd >= 0)
+        close(fd);
+    return res;
+}
+
+static int verify(struct verify_arena_s* arena, const char* app_path, const char* cert_path)
+{
+    size_t comment_len;
     int res = -1;
 
     // open file
     assert_res(app_path);
-    zFile = unzOpen(app_path);
-    assert_res(zFile != NULL, "file format error");
-    res = unzGetGlobalInfo64(zFile, &zGlobalInfo);
-    assert_res(res == UNZ_OK);
-    res = unzClose(zFile);
-    assert_res(res == UNZ_OK);
+    res = find_eocd(arena, app_path, &comment_len);
+    assert_res(res == 0);
 
     // Verify app legitimacy
-    res = verify_app(app_path, cert_path, zGlobalInfo.size_comment);
+    res = verify_app(arena, app_path, cert_path, comment_len);
     assert_res(res == 0);
 
 error:
@@ -456,6 +516,8 @@ int main(int argc, char* argv[])
     int res;
     const char* file;
     const char* cert;
+    struct verify_arena_s arena;
+    void* base = NULL;
 
     if (argc != 3) {
         printf("%s <file> <avbkey>\n", argv[0]);
@@ -470,9 +532,19 @@ int main(int argc, char* argv[])
     res = access(cert, F_OK);
     assert_res(0 == res, "Cert not found");
 
-    res = verify(file, cert);
+    // Everything below is allocated from one block taken up front
+    res = -ENOMEM;
+    base = malloc(CONFIG_UTILS_ZIP_VERIFY_ARENA_SIZE);
+    assert_res(base != NULL, "No memory for the arena");
+    verify_arena_init(&arena, "CONFIG_UTILS_ZIP_VERIFY_ARENA_SIZE", base,
+        CONFIG_UTILS_ZIP_VERIFY_ARENA_SIZE);
+
+    res = verify(&arena, file, cert);
+    syslog(LOG_INFO, "zip_verify: arena peak %zu of %d bytes\n", arena.peak,
+        CONFIG_UTILS_ZIP_VERIFY_ARENA_SIZE);
     assert_res(0 == res, "File verify failed");
 
 error:
+    free(base);
     return res;
 }